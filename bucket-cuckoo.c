@@ -0,0 +1,315 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Bucketized Cuckoo hashing.
+ *
+ * Each key hashes to two buckets of four slots.  A bucket is exactly
+ * one cache line of keys and values, so a lookup touches at most two
+ * lines and searches each with a single compare; with four slots per
+ * choice, random-walk insertion reaches loads above 90% before the
+ * table has to grow.
+ *
+ * @see Erlingsson, Úlfar; Manasse, Mark; McSherry, Frank (2006). "A
+ * cool and practical alternative to traditional hash tables". WDAS
+ * 2006.
+ */
+
+#include "bucket-cuckoo.h"
+#include "ensure.h"
+#include "bithacks.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_MATCH 1
+#include <immintrin.h>
+#endif
+
+/* Two multiply-shift hashes; the top bits of the product pick the
+ * bucket. */
+static inline size_t bucket_1(const bucket_cuckoo *bc, uint64_t key)
+{
+     return (key * 0x9e3779b97f4a7c15ULL) >> bc->shift;
+}
+
+static inline size_t bucket_2(const bucket_cuckoo *bc, uint64_t key)
+{
+     return ((key ^ (key>>32)) * 0xc2b2ae3d27d4eb4fULL) >> bc->shift;
+}
+
+/* Bitmap of the slots of @a b holding @a key. */
+static inline unsigned match(const bucket_cuckoo_bucket *b, uint64_t key)
+{
+     unsigned m = 0;
+     for (int j = 0; j < BUCKET_CUCKOO_WAYS; ++j)
+          m |= (b->key[j] == key) << j;
+     return m;
+}
+
+/* Lookups compare a bucket's four keys at once with AVX2 when cpuid
+ * says the CPU has it, whatever the build targets; inserts keep to the
+ * loop above. */
+#ifdef HAVE_AVX2_MATCH
+__attribute__((target("avx2")))
+static inline unsigned match_avx2(const bucket_cuckoo_bucket *b, uint64_t key)
+{
+     __m256i k = _mm256_load_si256((const __m256i *)b->key);
+     return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k, _mm256_set1_epi64x(key))));
+}
+
+/* 1 to use match_avx2, 0 not to, -1 until cpuid has been asked. */
+static int use_avx2 = -1;
+
+static bool have_avx2(void)
+{
+     int u = __atomic_load_n(&use_avx2, __ATOMIC_RELAXED);
+     if (u < 0) {
+          __builtin_cpu_init();
+          u = __builtin_cpu_supports("avx2");
+          __atomic_store_n(&use_avx2, u, __ATOMIC_RELAXED);
+     }
+     return u;
+}
+#endif
+
+static void allocate(bucket_cuckoo *bc, size_t n_buckets)
+{
+     bc->n_buckets = n_buckets;
+     bc->shift = 64 - __builtin_ctzll(n_buckets);
+     ENSURE(bc->buckets = aligned_alloc(sizeof bc->buckets[0], n_buckets * sizeof bc->buckets[0]));
+     memset(bc->buckets, 0, n_buckets * sizeof bc->buckets[0]);
+}
+
+bucket_cuckoo bucket_cuckoo_new(size_t initial_size)
+{
+     bucket_cuckoo bc = {0};
+     size_t n = ceil_pow2((initial_size + BUCKET_CUCKOO_WAYS-1) / BUCKET_CUCKOO_WAYS);
+     allocate(&bc, n < 2 ? 2 : n);
+     return bc;
+}
+
+#define LOOKUP(match) do {                                               \
+          bucket_cuckoo_bucket *b1 = &bc->buckets[bucket_1(bc, key)];   \
+          bucket_cuckoo_bucket *b2 = &bc->buckets[bucket_2(bc, key)];   \
+          __builtin_prefetch(b2);                                       \
+          unsigned m;                                                   \
+          if ((m = match(b1, key))) return &b1->value[ffs(m)-1];        \
+          if ((m = match(b2, key))) return &b2->value[ffs(m)-1];        \
+          return NULL;                                                  \
+     } while (0)
+
+#ifdef HAVE_AVX2_MATCH
+__attribute__((target("avx2")))
+static inline uint64_t *lookup_avx2(bucket_cuckoo *bc, uint64_t key)
+{
+     LOOKUP(match_avx2);
+}
+#endif
+
+static uint64_t *lookup(bucket_cuckoo *bc, uint64_t key)
+{
+#ifdef HAVE_AVX2_MATCH
+     if (have_avx2()) return lookup_avx2(bc, key);
+#endif
+     LOOKUP(match);
+}
+#undef LOOKUP
+
+enum { MAX_KICKS = 500 };
+
+/* Store *key in a free slot of one of its buckets, evicting along a
+ * random walk if need be.  On failure, *key and *value hold whichever
+ * entry was left homeless. */
+static bool place(bucket_cuckoo *bc, uint64_t *key, uint64_t *value)
+{
+     size_t b = bucket_1(bc, *key);
+     unsigned m = match(&bc->buckets[b], 0);
+     if (!m) {
+          b = bucket_2(bc, *key);
+          m = match(&bc->buckets[b], 0);
+     }
+     for (unsigned n = MAX_KICKS; ; --n) {
+          bucket_cuckoo_bucket *bk = &bc->buckets[b];
+          if (m) {
+               int j = ffs(m)-1;
+               bk->key[j] = *key;
+               bk->value[j] = *value;
+               return true;
+          }
+          if (n == 0) return false;
+
+          int j = n % BUCKET_CUCKOO_WAYS;
+          uint64_t k = bk->key[j], v = bk->value[j];
+          bk->key[j] = *key;
+          bk->value[j] = *value;
+          *key = k;
+          *value = v;
+          size_t b1 = bucket_1(bc, k);
+          b = b1 == b ? bucket_2(bc, k) : b1;
+          m = match(&bc->buckets[b], 0);
+     }
+}
+
+static bool rehash(bucket_cuckoo *bc, const bucket_cuckoo *old)
+{
+     for (size_t i = 0; i < old->n_buckets; ++i) {
+          for (int j = 0; j < BUCKET_CUCKOO_WAYS; ++j) {
+               uint64_t k = old->buckets[i].key[j], v = old->buckets[i].value[j];
+               if (k && !place(bc, &k, &v)) return false;
+          }
+     }
+     return true;
+}
+
+static void grow(bucket_cuckoo *bc)
+{
+     bucket_cuckoo old = *bc;
+     for (size_t n = old.n_buckets<<1; ; n <<= 1) {
+          allocate(bc, n);
+          if (rehash(bc, &old)) break;
+          free(bc->buckets);
+     }
+     free(old.buckets);
+}
+
+void bucket_cuckoo_insert(bucket_cuckoo *bc, uint64_t key, uint64_t value)
+{
+     if (key == 0) {
+          bc->n_entries += !bc->has_zero;
+          bc->has_zero = true;
+          bc->zero_value = value;
+          return;
+     }
+     uint64_t *v = lookup(bc, key);
+     if (v) {
+          *v = value;
+          return;
+     }
+     ++bc->n_entries;
+     while (!place(bc, &key, &value))
+          grow(bc);
+}
+
+bool bucket_cuckoo_find(bucket_cuckoo *bc, uint64_t key, uint64_t *value)
+{
+     if (key == 0) {
+          if (bc->has_zero && value) *value = bc->zero_value;
+          return bc->has_zero;
+     }
+     uint64_t *v = lookup(bc, key);
+     if (v && value) *value = *v;
+     return v != NULL;
+}
+
+void bucket_cuckoo_free(bucket_cuckoo *bc)
+{
+     if (bc->buckets) free(bc->buckets);
+     *bc = (bucket_cuckoo){0};
+}
+
+
+#ifdef UNIT_TEST
+
+#include <tap.h>
+#include <time.h>
+
+void test_basic_ops_randomized()
+{
+     int t = time(NULL);
+     note("%s: seed %d", __func__, t);
+     srand(t);
+
+     enum { N = 4096 };
+     static uint64_t keys[N], values[N];
+     bucket_cuckoo bc = bucket_cuckoo_new(0);
+     for (int i = 0; i < N; i++) {
+          keys[i] = (uint64_t)rand() << 31 | rand();
+          if (i == 0) keys[i] = 0;
+          values[i] = rand();
+          bucket_cuckoo_insert(&bc, keys[i], values[i]);
+     }
+     /* Reinserting must overwrite rather than duplicate. */
+     for (int i = 0; i < N; i += 2) {
+          values[i] = ~values[i];
+          bucket_cuckoo_insert(&bc, keys[i], values[i]);
+     }
+
+     int success = bc.n_entries <= N;
+     for (int i = 0; i < N; i++) {
+          uint64_t v;
+          success &= bucket_cuckoo_find(&bc, keys[i], &v) && v == values[i];
+     }
+     success &= !bucket_cuckoo_find(&bc, 1ULL<<63, NULL);
+     ok(success, "all keys found and values match");
+
+     bucket_cuckoo_free(&bc);
+}
+
+void test_load_before_growth()
+{
+     note(__func__);
+
+     enum { SLOTS = 1<<14 };
+     bucket_cuckoo bc = bucket_cuckoo_new(SLOTS);
+     while (bc.n_buckets * BUCKET_CUCKOO_WAYS == SLOTS)
+          bucket_cuckoo_insert(&bc, (uint64_t)rand() << 31 | rand(), 1);
+     double load = (double)(bc.n_entries-1) / SLOTS;
+     note("grew at load %f", load);
+     ok(load > 0.9, "load factor above 0.9 before growing");
+
+     bucket_cuckoo_free(&bc);
+}
+
+/* The AVX2 and scalar matches, each where the CPU allows, find the
+ * same keys. */
+void test_match_paths()
+{
+     note(__func__);
+
+     enum { N = 4096 };
+     static uint64_t keys[N];
+     bucket_cuckoo bc = bucket_cuckoo_new(0);
+     for (int i = 0; i < N; i++) {
+          keys[i] = (uint64_t)rand() << 31 | rand() | 1;
+          bucket_cuckoo_insert(&bc, keys[i], i);
+     }
+#ifdef HAVE_AVX2_MATCH
+     int paths = have_avx2() ? 2 : 1;
+#else
+     int paths = 1;
+#endif
+     int success = 1;
+     for (int p = 0; p < paths; p++) {
+#ifdef HAVE_AVX2_MATCH
+          use_avx2 = paths - 1 - p;
+#endif
+          for (int i = 0; i < N; i++) {
+               uint64_t v;
+               success &= bucket_cuckoo_find(&bc, keys[i], &v) && keys[v] == keys[i];
+          }
+          success &= !bucket_cuckoo_find(&bc, 2, NULL);
+     }
+#ifdef HAVE_AVX2_MATCH
+     use_avx2 = -1;
+#endif
+     ok(success, "lookups agree on %d match path%s", paths, paths > 1 ? "s" : "");
+     bucket_cuckoo_free(&bc);
+}
+
+int main()
+{
+     struct {
+          void (*fn)();
+          int count;
+     } tests[] = {
+          {test_basic_ops_randomized, 1},
+          {test_load_before_growth, 1},
+          {test_match_paths, 1}
+     };
+
+     int i, count = 0, n = (sizeof tests)/(sizeof tests[0]);
+     for (i = 0; i < n; i++)
+          count += tests[i].count;
+     plan(count, "bucket-cuckoo");
+     for (i = 0; i < n; i++)
+          tests[i].fn();
+     done_testing();
+}
+
+#endif
@@ -0,0 +1,35 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Bucketized Cuckoo hash table: each key has two candidate buckets
+ * of four slots, and each bucket is one 64-byte cache line holding
+ * the keys and values inline.
+ * @file bucket-cuckoo.h
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+enum { BUCKET_CUCKOO_WAYS = 4 };
+
+typedef struct bucket_cuckoo_bucket {
+     uint64_t key[BUCKET_CUCKOO_WAYS];
+     uint64_t value[BUCKET_CUCKOO_WAYS];
+} __attribute__((aligned(64))) bucket_cuckoo_bucket;
+
+/** Empty slots hold key 0, so the key 0 itself is kept out of line in
+ * @c has_zero and @c zero_value. */
+typedef struct bucket_cuckoo {
+     size_t n_buckets;          /* Always a power of two. */
+     unsigned shift;            /* 64 - log2(n_buckets) */
+     size_t n_entries;
+     bucket_cuckoo_bucket *buckets;
+     bool has_zero;
+     uint64_t zero_value;
+} bucket_cuckoo;
+
+extern bucket_cuckoo bucket_cuckoo_new(size_t initial_size);
+/** Insert @a key, replacing its value if it is already present. */
+extern void bucket_cuckoo_insert(bucket_cuckoo *bc, uint64_t key, uint64_t value);
+extern bool bucket_cuckoo_find(bucket_cuckoo *bc, uint64_t key, uint64_t *value);
+extern void bucket_cuckoo_free(bucket_cuckoo *bc);
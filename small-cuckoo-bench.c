@@ -0,0 +1,236 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Throughput comparison of the cuckoo table variants.
+ *
+ * Build with something like
+ *   cc -O2 -march=native small-cuckoo-bench.c small-cuckoo.c small-cuckoo32.c bucket-cuckoo.c
+ * adding -DSMALL_CUCKOO_STATS for displacement path lengths.
+ * @file small-cuckoo-bench.c
+ */
+
+#include "small-cuckoo.h"
+#include "small-cuckoo32.h"
+#include "bucket-cuckoo.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* splitmix64, so keys are reproducible from run to run. */
+static uint64_t next_key(uint64_t *state)
+{
+     uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+     z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+     z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+     return z ^ (z>>31);
+}
+
+enum { LOOKUP_ROUNDS = 20 };
+
+static uint64_t *hits, *misses;
+static volatile uint64_t sink;
+
+static void report(const char *name, size_t n, double insert, double hit, double miss, double load)
+{
+     printf("%-14s %6zu keys  insert %6.1f ns  hit %6.1f ns  miss %6.1f ns  load %.2f\n",
+            name, n, insert * 1e9 / n, hit * 1e9 / (n * LOOKUP_ROUNDS),
+            miss * 1e9 / (n * LOOKUP_ROUNDS), load);
+}
+
+static void bench_small_cuckoo(const char *name, size_t n, small_cuckoo_hash_fn *hash, unsigned ways,
+                               unsigned flags)
+{
+#ifdef SMALL_CUCKOO_STATS
+     small_cuckoo_stats = (struct small_cuckoo_stats){0};
+#endif
+     double t0 = now();
+     small_cuckoo sc = small_cuckoo_new_opts(0, &(small_cuckoo_opts){ .hash = hash, .ways = ways, .flags = flags });
+     for (size_t i = 0; i < n; ++i)
+          small_cuckoo_insert(&sc, hits[i], i);
+     double t1 = now();
+     uint64_t v, sum = 0;
+     for (int r = 0; r < LOOKUP_ROUNDS; ++r)
+          for (size_t i = 0; i < n; ++i)
+               sum += small_cuckoo_find(&sc, hits[i], &v) ? v : 0;
+     double t2 = now();
+     for (int r = 0; r < LOOKUP_ROUNDS; ++r)
+          for (size_t i = 0; i < n; ++i)
+               sum += small_cuckoo_find(&sc, misses[i], NULL);
+     double t3 = now();
+     sink = sum;
+     report(name, n, t1-t0, t2-t1, t3-t2, (double)(sc.n_entries-1) / sc.table_size);
+#ifdef SMALL_CUCKOO_STATS
+     printf("%-14s path length avg %.3f max %u over %llu placements\n", "",
+            (double)small_cuckoo_stats.moves / small_cuckoo_stats.placements,
+            small_cuckoo_stats.max_moves, (unsigned long long)small_cuckoo_stats.placements);
+#endif
+     small_cuckoo_free(&sc);
+}
+
+/* small_cuckoo_find_batch against a loop of small_cuckoo_find over
+ * the same hits and misses, a batch of BATCH keys at a time. */
+enum { BATCH = 64 };
+
+static void bench_find_batch(const char *name, size_t n, small_cuckoo_hash_fn *hash, unsigned ways)
+{
+     small_cuckoo sc = small_cuckoo_new_opts(0, &(small_cuckoo_opts){ .hash = hash, .ways = ways });
+     for (size_t i = 0; i < n; ++i)
+          small_cuckoo_insert(&sc, hits[i], i);
+     uint64_t v, values[BATCH], mask[BATCH/64], sum = 0;
+     for (int pass = 0; pass < 2; ++pass) {
+          const uint64_t *keys = pass ? misses : hits;
+          double t0 = now();
+          for (int r = 0; r < LOOKUP_ROUNDS; ++r)
+               for (size_t i = 0; i < n; ++i)
+                    sum += small_cuckoo_find(&sc, keys[i], &v) ? v : 0;
+          double t1 = now();
+          for (int r = 0; r < LOOKUP_ROUNDS; ++r)
+               for (size_t i = 0; i < n; i += BATCH) {
+                    size_t m = n - i < BATCH ? n - i : BATCH;
+                    small_cuckoo_find_batch(&sc, keys + i, m, values, mask);
+                    sum += mask[0] + values[0];
+               }
+          double t2 = now();
+          printf("%-14s %6zu keys  %s by find %6.1f ns  by find_batch %6.1f ns\n", pass ? "" : name, n,
+                 pass ? "miss" : "hit ", (t1-t0) * 1e9 / (n * LOOKUP_ROUNDS), (t2-t1) * 1e9 / (n * LOOKUP_ROUNDS));
+     }
+     sink = sum;
+     small_cuckoo_free(&sc);
+}
+
+/* The same with small_cuckoo32, at sizes beyond L2, where each
+ * lookup misses on both its slot and its entry. */
+static void bench_find_batch32(const char *name, size_t n, small_cuckoo_hash_fn *hash)
+{
+     small_cuckoo32 sc = small_cuckoo32_new_opts(0, &(small_cuckoo_opts){ .hash = hash });
+     for (size_t i = 0; i < n; ++i)
+          small_cuckoo32_insert(&sc, hits[i], i);
+     uint64_t v, values[BATCH], mask[BATCH/64], sum = 0;
+     for (int pass = 0; pass < 2; ++pass) {
+          const uint64_t *keys = pass ? misses : hits;
+          double t0 = now();
+          for (size_t i = 0; i < n; ++i)
+               sum += small_cuckoo32_find(&sc, keys[i], &v) ? v : 0;
+          double t1 = now();
+          for (size_t i = 0; i < n; i += BATCH) {
+               size_t m = n - i < BATCH ? n - i : BATCH;
+               small_cuckoo32_find_batch(&sc, keys + i, m, values, mask);
+               sum += mask[0] + values[0];
+          }
+          double t2 = now();
+          printf("%-14s %7zu keys  %s by find %6.1f ns  by find_batch %6.1f ns\n", pass ? "" : name, n,
+                 pass ? "miss" : "hit ", (t1-t0) * 1e9 / n, (t2-t1) * 1e9 / n);
+     }
+     sink = sum;
+     small_cuckoo32_free(&sc);
+}
+
+static void bench_build(size_t n)
+{
+     double t0 = now();
+     small_cuckoo sc = small_cuckoo_new(0);
+     for (size_t i = 0; i < n; ++i)
+          small_cuckoo_insert(&sc, hits[i], i);
+     double t1 = now();
+     small_cuckoo_free(&sc);
+     double t2 = now();
+     sc = small_cuckoo_build(hits, NULL, n);
+     double t3 = now();
+     printf("%-14s %6zu keys  by insert %6.1f ns  by build %6.1f ns  load %.2f\n",
+            "construction", n, (t1-t0) * 1e9 / n, (t3-t2) * 1e9 / n,
+            (double)(sc.n_entries-1) / sc.table_size);
+     small_cuckoo_free(&sc);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+     double x = *(const double *)a, y = *(const double *)b;
+     return (x > y) - (x < y);
+}
+
+/* Tail latency of single inserts, where resizing shows up; @a reserve
+ * sizes the table for all @a n first, leaving only the per-insert
+ * work. */
+static void bench_insert_latency(const char *name, size_t n, unsigned flags, bool reserve)
+{
+     double *t = malloc(n * sizeof *t);
+     if (!t) return;
+     small_cuckoo sc = small_cuckoo_new_opts(0, &(small_cuckoo_opts){ .flags = flags });
+     if (reserve) small_cuckoo_reserve(&sc, n);
+     for (size_t i = 0; i < n; ++i) {
+          double t0 = now();
+          small_cuckoo_insert(&sc, hits[i], i);
+          t[i] = now() - t0;
+     }
+     small_cuckoo_free(&sc);
+     qsort(t, n, sizeof *t, compare_doubles);
+     printf("%-14s %6zu keys  insert p50 %6.1f ns  p99.9 %8.1f ns  max %8.1f ns\n",
+            name, n, t[n/2] * 1e9, t[n - n/1000 - 1] * 1e9, t[n-1] * 1e9);
+     free(t);
+}
+
+static void bench_bucket_cuckoo(size_t n)
+{
+     double t0 = now();
+     bucket_cuckoo bc = bucket_cuckoo_new(0);
+     for (size_t i = 0; i < n; ++i)
+          bucket_cuckoo_insert(&bc, hits[i], i);
+     double t1 = now();
+     uint64_t v, sum = 0;
+     for (int r = 0; r < LOOKUP_ROUNDS; ++r)
+          for (size_t i = 0; i < n; ++i)
+               sum += bucket_cuckoo_find(&bc, hits[i], &v) ? v : 0;
+     double t2 = now();
+     for (int r = 0; r < LOOKUP_ROUNDS; ++r)
+          for (size_t i = 0; i < n; ++i)
+               sum += bucket_cuckoo_find(&bc, misses[i], NULL);
+     double t3 = now();
+     sink = sum;
+     report("bucket_cuckoo", n, t1-t0, t2-t1, t3-t2,
+            (double)bc.n_entries / (bc.n_buckets * BUCKET_CUCKOO_WAYS));
+     bucket_cuckoo_free(&bc);
+}
+
+int main()
+{
+     static const size_t sizes[] = { 1000, 10000, 30000, 60000 };
+     enum { MAX_N = 2000000 };
+     uint64_t state = 1;
+     hits = malloc(MAX_N * sizeof *hits);
+     misses = malloc(MAX_N * sizeof *misses);
+     if (!hits || !misses) return 1;
+     for (size_t i = 0; i < MAX_N; ++i) {
+          hits[i] = next_key(&state);
+          misses[i] = next_key(&state);
+     }
+
+     for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+          bench_small_cuckoo("small_cuckoo", sizes[i], NULL, 2, 0);
+          bench_small_cuckoo("  cached hash", sizes[i], NULL, 2, SMALL_CUCKOO_CACHE_HASHES);
+          bench_small_cuckoo("  split hash", sizes[i], small_cuckoo_split_hash, 2, 0);
+          bench_small_cuckoo("  3 ways", sizes[i], small_cuckoo_split_hash, 3, 0);
+          bench_small_cuckoo("  3 ways+cache", sizes[i], small_cuckoo_split_hash, 3, SMALL_CUCKOO_CACHE_HASHES);
+          bench_small_cuckoo("  4 ways", sizes[i], small_cuckoo_split_hash, 4, 0);
+          bench_small_cuckoo("  huge pages", sizes[i], NULL, 2, SMALL_CUCKOO_HUGE_PAGES | SMALL_CUCKOO_PREFAULT);
+          bench_small_cuckoo("  concurrent", sizes[i], NULL, 2, SMALL_CUCKOO_CONCURRENT);
+          bench_bucket_cuckoo(sizes[i]);
+          bench_find_batch("batch", sizes[i], NULL, 2);
+          bench_find_batch("  split hash", sizes[i], small_cuckoo_split_hash, 2);
+          bench_find_batch("  4 ways", sizes[i], small_cuckoo_split_hash, 4);
+          bench_build(sizes[i]);
+          bench_insert_latency("latency", sizes[i], 0, false);
+          bench_insert_latency("  incremental", sizes[i], SMALL_CUCKOO_INCREMENTAL, false);
+          bench_insert_latency("  realtime", sizes[i], SMALL_CUCKOO_INCREMENTAL | SMALL_CUCKOO_REALTIME, false);
+          bench_insert_latency("  rt reserved", sizes[i], SMALL_CUCKOO_INCREMENTAL | SMALL_CUCKOO_REALTIME, true);
+     }
+     bench_find_batch32("wide batch", MAX_N, NULL);
+     bench_find_batch32("  split hash", MAX_N, small_cuckoo_split_hash);
+     free(hits);
+     free(misses);
+     return 0;
+}
@@ -0,0 +1,370 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Extendible hashing with small_cuckoo tables as leaves.
+ *
+ * Leaf i of a directory of depth g holds the keys whose hash starts
+ * with the g bits of i; a leaf of depth d < g is shared by the 2^(g-d)
+ * entries that agree in its first d bits, which are always adjacent.
+ * Splitting a full leaf only touches its own keys and its own run of
+ * the directory, so the cost of growth stays bounded by the leaf size
+ * however big the whole gets.
+ */
+
+#include "small-cuckoo-dir.h"
+#include "ensure.h"
+
+/* The bits routing a key, a hash of its own so as not to correlate
+ * with the leaves' hash pairs; the directory takes them from the top.
+ * splitmix64's finalizer, so every bit depends on the whole key, and
+ * invertible, so distinct keys always part by the 64th split. */
+static inline uint64_t route(uint64_t key)
+{
+     key = (key ^ (key>>30)) * 0xbf58476d1ce4e5b9ULL;
+     key = (key ^ (key>>27)) * 0x94d049bb133111ebULL;
+     return key ^ (key>>31);
+}
+
+static inline size_t dir_index(const small_cuckoo_dir *dir, uint64_t h)
+{
+     return dir->depth ? h >> (64 - dir->depth) : 0;
+}
+
+static inline small_cuckoo_dir_leaf *leaf_of(small_cuckoo_dir *dir, uint64_t key)
+{
+     return dir->leaves[dir_index(dir, route(key))];
+}
+
+static void *dir_alloc(const small_cuckoo_dir *dir, size_t size)
+{
+     const small_cuckoo_allocator *a = &dir->allocator;
+     return a->alloc ? a->alloc(a->ctx, size) : malloc(size);
+}
+
+static void *dir_realloc(const small_cuckoo_dir *dir, void *p, size_t old_size, size_t new_size)
+{
+     const small_cuckoo_allocator *a = &dir->allocator;
+     return a->realloc ? a->realloc(a->ctx, p, old_size, new_size) : realloc(p, new_size);
+}
+
+static void dir_free(const small_cuckoo_dir *dir, void *p, size_t size)
+{
+     const small_cuckoo_allocator *a = &dir->allocator;
+     if (a->free) a->free(a->ctx, p, size);
+     else free(p);
+}
+
+/* A leaf with room for @a n keys before its table grows. */
+static small_cuckoo_dir_leaf *new_leaf(small_cuckoo_dir *dir, unsigned depth, size_t n)
+{
+     small_cuckoo_opts opts = dir->opts;
+     opts.allocator = dir->allocator.alloc ? &dir->allocator : NULL;
+     small_cuckoo_dir_leaf *leaf;
+     ENSURE(leaf = dir_alloc(dir, sizeof *leaf));
+     leaf->table = small_cuckoo_new_opts(n, &opts);
+     leaf->depth = depth;
+     return leaf;
+}
+
+static void free_leaf(small_cuckoo_dir *dir, small_cuckoo_dir_leaf *leaf)
+{
+     small_cuckoo_free(&leaf->table);
+     dir_free(dir, leaf, sizeof *leaf);
+}
+
+/* Leaves are reached through the directory, which has no seqlock of
+ * its own, so SMALL_CUCKOO_CONCURRENT would only be a false promise. */
+static void set_opts(small_cuckoo_dir *dir, const small_cuckoo_opts *opts)
+{
+     if (opts) {
+          ENSURE(!(opts->flags & SMALL_CUCKOO_CONCURRENT));
+          dir->opts = *opts;
+          if (opts->allocator) dir->allocator = *opts->allocator;
+     }
+     dir->opts.allocator = NULL;
+}
+
+small_cuckoo_dir small_cuckoo_dir_new(const small_cuckoo_opts *opts)
+{
+     small_cuckoo_dir dir = {0};
+     set_opts(&dir, opts);
+     ENSURE(dir.leaves = dir_alloc(&dir, sizeof dir.leaves[0]));
+     dir.leaves[0] = new_leaf(&dir, 0, SMALL_CUCKOO_DIR_LEAF_KEYS);
+     return dir;
+}
+
+/* Entries in a directory of depth @a depth. */
+static inline size_t dir_len(unsigned depth)
+{
+     return (size_t)1 << depth;
+}
+
+/* Double the directory, each leaf taking twice as many entries. */
+static void deepen(small_cuckoo_dir *dir)
+{
+     size_t n = dir_len(dir->depth);
+     ENSURE(dir->depth < 8*sizeof(size_t) - 1);
+     ENSURE(dir->leaves = dir_realloc(dir, dir->leaves, n * sizeof dir->leaves[0],
+                                      2*n * sizeof dir->leaves[0]));
+     for (size_t i = n; i-- > 0; )
+          dir->leaves[2*i] = dir->leaves[2*i+1] = dir->leaves[i];
+     ++dir->depth;
+}
+
+/* Split the leaf at directory entry @a i on the next bit of the hash.
+ * If a half gives up a key, the halves are thrown away and the leaf
+ * kept whole, and we return false. */
+static bool split(small_cuckoo_dir *dir, size_t i)
+{
+     small_cuckoo_dir_leaf *old = dir->leaves[i];
+     ENSURE(old->depth < 64);
+     if (old->depth == dir->depth) {
+          deepen(dir);
+          i *= 2;
+     }
+     /* Each half is sized for the keys it gets, so a lopsided split
+      * doesn't leave a leaf of empty slots. */
+     size_t n[2] = {0, 0};
+     for (uint32_t j = 1; j < old->table.n_entries; ++j)
+          ++n[route(old->table.entries[j].key) >> (63 - old->depth) & 1];
+     small_cuckoo_dir_leaf *half[2] = { new_leaf(dir, old->depth+1, n[0]), new_leaf(dir, old->depth+1, n[1]) };
+     for (uint32_t j = 1; j < old->table.n_entries; ++j) {
+          uint64_t key = old->table.entries[j].key;
+          unsigned bit = route(key) >> (63 - old->depth) & 1;
+          if (!small_cuckoo_insert(&half[bit]->table, key, old->table.entries[j].value)) {
+               free_leaf(dir, half[0]);
+               free_leaf(dir, half[1]);
+               return false;
+          }
+     }
+     size_t span = dir_len(dir->depth - old->depth), start = i & ~(span-1);
+     for (size_t j = 0; j < span; ++j)
+          dir->leaves[start + j] = half[j >= span/2];
+     free_leaf(dir, old);
+     return true;
+}
+
+/* The table @a key goes in, split until it has room if need be; a
+ * leaf that can't be split takes it full. */
+static small_cuckoo *table_for_insert(small_cuckoo_dir *dir, uint64_t key)
+{
+     uint64_t h = route(key);
+     for (;;) {
+          size_t i = dir_index(dir, h);
+          small_cuckoo *t = &dir->leaves[i]->table;
+          if (t->n_entries-1 < SMALL_CUCKOO_DIR_LEAF_KEYS || small_cuckoo_find(t, key, NULL) ||
+              !split(dir, i))
+               return t;
+     }
+}
+
+bool small_cuckoo_dir_insert(small_cuckoo_dir *dir, uint64_t key, uint64_t value)
+{
+     small_cuckoo *t = table_for_insert(dir, key);
+     /* Copies of a key never part when their leaf splits, so a full
+      * leaf takes none: enough of them would split it without end. */
+     if (t->n_entries-1 >= SMALL_CUCKOO_DIR_LEAF_KEYS)
+          return small_cuckoo_upsert(t, key, value) != NULL;
+     return small_cuckoo_insert(t, key, value);
+}
+
+uint64_t *small_cuckoo_dir_find_or_insert(small_cuckoo_dir *dir, uint64_t key, uint64_t value)
+{
+     return small_cuckoo_find_or_insert(table_for_insert(dir, key), key, value);
+}
+
+uint64_t *small_cuckoo_dir_upsert(small_cuckoo_dir *dir, uint64_t key, uint64_t value)
+{
+     return small_cuckoo_upsert(table_for_insert(dir, key), key, value);
+}
+
+bool small_cuckoo_dir_find(small_cuckoo_dir *dir, uint64_t key, uint64_t *value)
+{
+     return small_cuckoo_find(&leaf_of(dir, key)->table, key, value);
+}
+
+bool small_cuckoo_dir_erase(small_cuckoo_dir *dir, uint64_t key)
+{
+     return small_cuckoo_erase(&leaf_of(dir, key)->table, key);
+}
+
+/* Each leaf once, at the first of its run of entries. */
+#define FOR_EACH_LEAF(dir, i, leaf)                                     \
+     for (size_t i = 0; i < dir_len((dir)->depth); i += dir_len((dir)->depth - (dir)->leaves[i]->depth)) \
+          for (small_cuckoo_dir_leaf *leaf = (dir)->leaves[i]; leaf; leaf = NULL)
+
+size_t small_cuckoo_dir_size(const small_cuckoo_dir *dir)
+{
+     size_t n = 0;
+     FOR_EACH_LEAF(dir, i, leaf)
+          n += leaf->table.n_entries - 1;
+     return n;
+}
+
+void small_cuckoo_dir_free(small_cuckoo_dir *dir)
+{
+     if (!dir->leaves) return;
+     size_t n = dir_len(dir->depth);
+     for (size_t i = 0; i < n; ) {
+          small_cuckoo_dir_leaf *leaf = dir->leaves[i];
+          i += dir_len(dir->depth - leaf->depth);
+          free_leaf(dir, leaf);
+     }
+     dir_free(dir, dir->leaves, n * sizeof dir->leaves[0]);
+     *dir = (small_cuckoo_dir){0};
+}
+
+/* The directory's depth, then each leaf's depth and table in
+ * directory order; the directory is rebuilt from the depths. */
+void small_cuckoo_dir_serialize(int fd, small_cuckoo_dir *dir)
+{
+#define WRITE_UNDER(t,x,n) do { uint64_t u = t(x); ENSURE(n == write(fd, &u, n)); } while(0)
+     WRITE_UNDER(htole32, dir->depth, 4);
+     FOR_EACH_LEAF(dir, i, leaf) {
+          WRITE_UNDER(htole32, leaf->depth, 4);
+          small_cuckoo_serialize(fd, &leaf->table);
+     }
+#undef WRITE_UNDER
+}
+
+void small_cuckoo_dir_deserialize(int fd, small_cuckoo_dir *dir, const small_cuckoo_opts *opts)
+{
+     *dir = (small_cuckoo_dir){0};
+     set_opts(dir, opts);
+     small_cuckoo_opts leaf_opts = dir->opts;
+     leaf_opts.allocator = dir->allocator.alloc ? &dir->allocator : NULL;
+#define READ_AND(then,v,n) do { uint64_t u = 0; ENSURE(n == read(fd, &u, n)); v = then(u); } while(0)
+     READ_AND(le32toh, dir->depth, 4);
+     ENSURE(dir->depth < 8*sizeof(size_t));
+     size_t n = dir_len(dir->depth);
+     ENSURE(dir->leaves = dir_alloc(dir, n * sizeof dir->leaves[0]));
+     for (size_t i = 0; i < n; ) {
+          small_cuckoo_dir_leaf *leaf;
+          ENSURE(leaf = dir_alloc(dir, sizeof *leaf));
+          READ_AND(le32toh, leaf->depth, 4);
+          ENSURE(leaf->depth <= dir->depth);
+          small_cuckoo_deserialize_opts(fd, &leaf->table, &leaf_opts);
+          size_t span = dir_len(dir->depth - leaf->depth);
+          ENSURE(i % span == 0);
+          for (size_t j = 0; j < span; ++j)
+               dir->leaves[i++] = leaf;
+     }
+#undef READ_AND
+}
+
+
+#ifdef UNIT_TEST
+
+#include <tap.h>
+
+/* splitmix64, as in the benchmark. */
+static uint64_t next_key(uint64_t *state)
+{
+     uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+     z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+     z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+     return z ^ (z>>31);
+}
+
+enum { N = 300000 };
+static uint64_t keys[N];
+
+static int all_found(small_cuckoo_dir *dir, size_t n, uint64_t plus)
+{
+     int success = small_cuckoo_dir_size(dir) == n;
+     for (size_t i = 0; i < n; i++) {
+          uint64_t v;
+          success &= small_cuckoo_dir_find(dir, keys[i], &v) && v == i + plus;
+     }
+     return success;
+}
+
+void test_splits()
+{
+     note(__func__);
+
+     uint64_t state = 1;
+     small_cuckoo_dir dir = small_cuckoo_dir_new(NULL);
+     for (size_t i = 0; i < N; i++) {
+          keys[i] = next_key(&state);
+          small_cuckoo_dir_insert(&dir, keys[i], i);
+     }
+     unsigned n_leaves = 0, full = 0;
+     FOR_EACH_LEAF(&dir, i, leaf) {
+          ++n_leaves;
+          full += leaf->table.n_entries-1 > SMALL_CUCKOO_DIR_LEAF_KEYS;
+     }
+     note("depth %u, %u leaves", dir.depth, n_leaves);
+     ok(all_found(&dir, N, 0) && !full && n_leaves >= N / SMALL_CUCKOO_DIR_LEAF_KEYS,
+        "all keys found, no leaf over its limit");
+
+     for (size_t i = 0; i < N; i++)
+          ++*small_cuckoo_dir_find_or_insert(&dir, keys[i], 0);
+     int success = all_found(&dir, N, 1);
+     for (size_t i = N/2; i < N; i++)
+          success &= small_cuckoo_dir_erase(&dir, keys[i]);
+     success &= all_found(&dir, N/2, 1) && !small_cuckoo_dir_find(&dir, keys[N-1], NULL);
+     ok(success, "find_or_insert and erase reach the right leaf");
+
+     FILE *f = tmpfile();
+     small_cuckoo_dir_serialize(fileno(f), &dir);
+     small_cuckoo_dir_free(&dir);
+     rewind(f);
+     small_cuckoo_dir_deserialize(fileno(f), &dir, NULL);
+     fclose(f);
+     success = all_found(&dir, N/2, 1);
+     for (size_t i = N/2; i < N; i++)
+          small_cuckoo_dir_upsert(&dir, keys[i], i+1);
+     ok(success && all_found(&dir, N, 1), "deserialized directory finds every key and takes more");
+     small_cuckoo_dir_free(&dir);
+}
+
+void test_full_leaf()
+{
+     note(__func__);
+
+     enum { L = SMALL_CUCKOO_DIR_LEAF_KEYS };
+     uint64_t state = 1;
+     small_cuckoo_dir dir = small_cuckoo_dir_new(NULL);
+     for (size_t i = 0; i < L; i++) {
+          keys[i] = next_key(&state);
+          small_cuckoo_dir_insert(&dir, keys[i], i);
+     }
+     size_t full_size = dir.leaves[0]->table.table_size;
+     int success = 1;
+     for (int r = 0; r < 1000; r++)
+          success &= small_cuckoo_dir_insert(&dir, keys[0], 42);
+     uint64_t v;
+     success &= small_cuckoo_dir_find(&dir, keys[0], &v) && v == 42;
+     small_cuckoo_dir_insert(&dir, keys[0], 0);
+     ok(success && all_found(&dir, L, 0) && dir.depth == 0,
+        "a full leaf updates a key it holds rather than split");
+
+     keys[L] = next_key(&state);
+     small_cuckoo_dir_insert(&dir, keys[L], L);
+     size_t slots = 0;
+     FOR_EACH_LEAF(&dir, i, leaf)
+          slots += leaf->table.table_size;
+     note("split %zu slots into %zu across depth %u", full_size, slots, dir.depth);
+     ok(all_found(&dir, L+1, 0) && slots < 1.5 * full_size, "split leaves sized for the keys they got");
+     small_cuckoo_dir_free(&dir);
+}
+
+int main()
+{
+     struct {
+          void (*fn)();
+          int count;
+     } tests[] = {
+          {test_splits, 3},
+          {test_full_leaf, 2}
+     };
+
+     int i, count = 0, n = (sizeof tests)/(sizeof tests[0]);
+     for (i = 0; i < n; i++)
+          count += tests[i].count;
+     plan(count, "small-cuckoo-dir");
+     for (i = 0; i < n; i++)
+          tests[i].fn();
+     done_testing();
+}
+
+#endif
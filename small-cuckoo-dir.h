@@ -0,0 +1,57 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Extendible hashing over small_cuckoo leaves, for tables of millions
+ * of keys whose size isn't known in advance.  A directory indexed by
+ * the top bits of a key's hash points to leaves; a leaf that fills up
+ * splits in two on the next bit rather than growing, doubling the
+ * directory only if it was already as deep as the directory.
+ * @see Fagin, Ronald; Nievergelt, Jurg; Pippenger, Nicholas; Strong,
+ * H. Raymond (1979). "Extendible Hashing — A Fast Access Method for
+ * Dynamic Files". ACM Transactions on Database Systems 4(3).
+ * @file small-cuckoo-dir.h
+ */
+#pragma once
+
+#include "small-cuckoo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Keys a leaf holds before it splits.  The first leaf is sized for
+ * this many up front; the two halves of a split are sized for the
+ * keys each gets, and grow from there. */
+enum { SMALL_CUCKOO_DIR_LEAF_KEYS = 1<<14 };
+
+typedef struct small_cuckoo_dir_leaf {
+     small_cuckoo table;
+     unsigned depth;            /* Hash bits its keys all share. */
+} small_cuckoo_dir_leaf;
+
+typedef struct small_cuckoo_dir {
+     unsigned depth;            /* The directory has 2^depth entries. */
+     small_cuckoo_dir_leaf **leaves;
+     small_cuckoo_opts opts;    /* For new leaves, but for the allocator: */
+     small_cuckoo_allocator allocator; /* All NULL for malloc. */
+} small_cuckoo_dir;
+
+/** An empty directory of one leaf, whose leaves are all built with
+ * @a opts, which may not include SMALL_CUCKOO_CONCURRENT: directory
+ * lookups aren't safe against a writer. */
+extern small_cuckoo_dir small_cuckoo_dir_new(const small_cuckoo_opts *opts);
+/** As small_cuckoo_insert, except that a full leaf already holding
+ * @a key has its value replaced instead of taking a copy. */
+extern bool small_cuckoo_dir_insert(small_cuckoo_dir *dir, uint64_t key, uint64_t value);
+extern uint64_t *small_cuckoo_dir_find_or_insert(small_cuckoo_dir *dir, uint64_t key, uint64_t value);
+extern uint64_t *small_cuckoo_dir_upsert(small_cuckoo_dir *dir, uint64_t key, uint64_t value);
+extern bool small_cuckoo_dir_find(small_cuckoo_dir *dir, uint64_t key, uint64_t *value);
+/** Leaves shrink as they empty but never merge. */
+extern bool small_cuckoo_dir_erase(small_cuckoo_dir *dir, uint64_t key);
+extern size_t small_cuckoo_dir_size(const small_cuckoo_dir *dir);
+extern void small_cuckoo_dir_free(small_cuckoo_dir *dir);
+/** Each leaf is written with small_cuckoo_serialize, after its depth. */
+extern void small_cuckoo_dir_serialize(int fd, small_cuckoo_dir *dir);
+extern void small_cuckoo_dir_deserialize(int fd, small_cuckoo_dir *dir, const small_cuckoo_opts *opts);
+
+#ifdef __cplusplus
+}
+#endif
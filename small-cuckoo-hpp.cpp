@@ -0,0 +1,115 @@
+/** -*- mode: C++; c-file-style: "k&r" -*-
+ * Tests of the C++ front-end in small-cuckoo.hpp, one round for each
+ * hash policy.  Only has something in it when compiled with UNIT_TEST,
+ * say with
+ *   c++ -DUNIT_TEST small-cuckoo-hpp.cpp small-cuckoo.o
+ * @file small-cuckoo-hpp.cpp
+ */
+
+#ifdef UNIT_TEST
+
+#include "small-cuckoo.hpp"
+
+extern "C" {
+#include <tap.h>
+}
+
+enum { N = 20000 };
+
+/* splitmix64, as in the benchmark. */
+static uint64_t next_key(uint64_t *state)
+{
+     uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+     z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+     z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+     return z ^ (z>>31);
+}
+
+/* Insert, find (inlined and through the C interface), iterate, then
+ * erase half and check the rest. */
+template <class Hash>
+static void round_trip(const char *name)
+{
+     note("%s", name);
+
+     static uint64_t keys[N];
+     uint64_t state = 1;
+     basic_small_cuckoo<Hash> t;
+     for (size_t i = 0; i < N; i++) {
+          keys[i] = next_key(&state);
+          t.insert(keys[i], i);
+     }
+     bool success = t.size() == N;
+     for (size_t i = 0; i < N; i++) {
+          uint64_t v, w;
+          success &= t.find(keys[i], &v) && v == i;
+          success &= small_cuckoo_find(t.get(), keys[i], &w) && w == i;
+     }
+     success &= !t.find(next_key(&state));
+     ok(success, "%s: inserted keys found, inline and through the C interface", name);
+
+     small_cuckoo_iter it;
+     uint64_t seen = 0, sum = 0;
+     for (small_cuckoo_iterate(t.get(), &it); small_cuckoo_iter_has_next(&it); ++seen) {
+          uint64_t k, v;
+          small_cuckoo_iter_next(&it, &k, &v);
+          sum += v;
+          success &= v < N && keys[v] == k;
+     }
+     ok(success && seen == N && sum == (uint64_t)N*(N-1)/2, "%s: iteration visits each entry once", name);
+
+     success = true;
+     for (size_t i = 0; i < N; i += 2)
+          success &= small_cuckoo_erase(t.get(), keys[i]);
+     for (size_t i = 1; i < N; i += 2)
+          ++t.find_or_insert(keys[i]);
+     success &= t.size() == N/2;
+     for (size_t i = 0; i < N; i++) {
+          uint64_t v;
+          bool found = t.find(keys[i], &v);
+          success &= i % 2 ? found && v == i+1 : !found;
+     }
+     ok(success, "%s: erased keys gone, the rest updated in place", name);
+}
+
+/* The instruction and the bitwise loop agree, so which one the CPU
+ * gets never changes where a key goes. */
+static void crc32c_paths(const char *name)
+{
+     note("%s", name);
+     uint64_t state = 1;
+     bool success = true;
+#if defined(__x86_64__) && defined(__GNUC__)
+     for (int i = 0; i < 10000 && small_cuckoo_hash::crc32c::have_sse42(); i++) {
+          uint64_t k = next_key(&state);
+          success &= small_cuckoo_hash::crc32c::hard_crc(k) == small_cuckoo_hash::crc32c::soft_crc(k);
+     }
+#endif
+     ok(success, "%s: hardware and bitwise CRC32C agree", name);
+}
+
+int main()
+{
+     struct {
+          void (*fn)(const char *);
+          const char *name;
+          int count;
+     } tests[] = {
+          {crc32c_paths, "crc32c paths", 1},
+          {round_trip<small_cuckoo_hash::crc32c>, "crc32c", 3},
+          {round_trip<small_cuckoo_hash::multiply_shift>, "multiply_shift", 3},
+          {round_trip<small_cuckoo_hash::wymix>, "wymix", 3},
+          {round_trip<small_cuckoo_hash::split64>, "split64", 3},
+          {round_trip<small_cuckoo_hash::larson_jenkins>, "larson_jenkins", 3},
+     };
+
+     int i, count = 0, n = (sizeof tests)/(sizeof tests[0]);
+     for (i = 0; i < n; i++)
+          count += tests[i].count;
+     plan(count, "small-cuckoo-hpp");
+     for (i = 0; i < n; i++)
+          tests[i].fn(tests[i].name);
+     done_testing();
+}
+
+#endif
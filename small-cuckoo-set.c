@@ -0,0 +1,222 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Sharded small_cuckoo tables.
+ *
+ * A key's shard comes from a hash of its own rather than from bits of
+ * the shards' hash pair: with range reduction by multiplication,
+ * hash_1 and hash_2 use every bit they are given, so routing on some
+ * of them would leave each shard with keys that agree in those bits
+ * and crowd its table.
+ */
+
+#include "small-cuckoo-set.h"
+#include "ensure.h"
+
+/* splitmix64's last round, reduced to [0, n) by multiply-shift.  The
+ * constants are unlike any the built-in hashes multiply by. */
+static inline size_t shard_of(const small_cuckoo_set *set, uint64_t key)
+{
+     uint64_t h = (key ^ (key>>31)) * 0x94d049bb133111ebULL;
+     h ^= h>>29;
+     return ((h>>32) * set->n_shards) >> 32;
+}
+
+static inline small_cuckoo *shard(small_cuckoo_set *set, uint64_t key)
+{
+     return &set->shards[shard_of(set, key)];
+}
+
+/* Keys a shard can hold: its 16-bit indices name entries 1 to
+ * UINT16_MAX-1. */
+enum { SHARD_CAPACITY = 2*SMALL_CUCKOO_SET_SHARD_KEYS - 2 };
+
+static inline bool full(const small_cuckoo *sc)
+{
+     return sc->n_entries-1u >= SHARD_CAPACITY;
+}
+
+small_cuckoo_set small_cuckoo_set_new(size_t max_keys, const small_cuckoo_opts *opts)
+{
+     small_cuckoo_set set = {0};
+     set.n_shards = (max_keys + SMALL_CUCKOO_SET_SHARD_KEYS-1) / SMALL_CUCKOO_SET_SHARD_KEYS;
+     if (!set.n_shards) set.n_shards = 1;
+     ENSURE(set.n_shards <= UINT32_MAX);
+     size_t size = set.n_shards * sizeof set.shards[0];
+     if (opts && opts->allocator) {
+          set.allocator = *opts->allocator;
+          set.shards = set.allocator.alloc(set.allocator.ctx, size);
+     } else
+          set.shards = malloc(size);
+     ENSURE(set.shards);
+     for (size_t i = 0; i < set.n_shards; ++i)
+          set.shards[i] = small_cuckoo_new_opts(0, opts);
+     return set;
+}
+
+bool small_cuckoo_set_insert(small_cuckoo_set *set, uint64_t key, uint64_t value)
+{
+     small_cuckoo *sc = shard(set, key);
+     return !full(sc) && small_cuckoo_insert(sc, key, value);
+}
+
+/* A full shard still finds and updates the keys it has. */
+uint64_t *small_cuckoo_set_find_or_insert(small_cuckoo_set *set, uint64_t key, uint64_t value)
+{
+     small_cuckoo *sc = shard(set, key);
+     if (full(sc) && !small_cuckoo_find(sc, key, NULL)) return NULL;
+     return small_cuckoo_find_or_insert(sc, key, value);
+}
+
+uint64_t *small_cuckoo_set_upsert(small_cuckoo_set *set, uint64_t key, uint64_t value)
+{
+     small_cuckoo *sc = shard(set, key);
+     if (full(sc) && !small_cuckoo_find(sc, key, NULL)) return NULL;
+     return small_cuckoo_upsert(sc, key, value);
+}
+
+bool small_cuckoo_set_find(small_cuckoo_set *set, uint64_t key, uint64_t *value)
+{
+     return small_cuckoo_find(shard(set, key), key, value);
+}
+
+bool small_cuckoo_set_erase(small_cuckoo_set *set, uint64_t key)
+{
+     return small_cuckoo_erase(shard(set, key), key);
+}
+
+size_t small_cuckoo_set_size(const small_cuckoo_set *set)
+{
+     size_t n = 0;
+     for (size_t i = 0; i < set->n_shards; ++i)
+          n += set->shards[i].n_entries - 1;
+     return n;
+}
+
+void small_cuckoo_set_free(small_cuckoo_set *set)
+{
+     for (size_t i = 0; i < set->n_shards; ++i)
+          small_cuckoo_free(&set->shards[i]);
+     if (set->allocator.free)
+          set->allocator.free(set->allocator.ctx, set->shards, set->n_shards * sizeof set->shards[0]);
+     else
+          free(set->shards);
+     *set = (small_cuckoo_set){0};
+}
+
+
+#ifdef UNIT_TEST
+
+#include <tap.h>
+
+/* splitmix64, as in the benchmark. */
+static uint64_t next_key(uint64_t *state)
+{
+     uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+     z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+     z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+     return z ^ (z>>31);
+}
+
+enum { N = 400000 };
+static uint64_t keys[N];
+
+void test_many_keys()
+{
+     note(__func__);
+
+     uint64_t state = 1;
+     small_cuckoo_set set = small_cuckoo_set_new(N, NULL);
+     size_t *sizes = malloc(set.n_shards * sizeof *sizes);
+     for (size_t j = 0; j < set.n_shards; ++j)
+          sizes[j] = set.shards[j].table_size;
+     int one_at_a_time = 1;
+     for (size_t i = 0; i < N; i++) {
+          keys[i] = next_key(&state);
+          small_cuckoo_set_insert(&set, keys[i], i);
+          /* Only the shard the key went to may have grown. */
+          unsigned grown = 0;
+          for (size_t j = 0; j < set.n_shards; ++j) {
+               grown += sizes[j] != set.shards[j].table_size;
+               sizes[j] = set.shards[j].table_size;
+          }
+          one_at_a_time &= grown <= 1;
+     }
+     free(sizes);
+     note("%zu shards", set.n_shards);
+     ok(one_at_a_time, "growing rebuilds one shard at a time");
+
+     int success = small_cuckoo_set_size(&set) == N;
+     for (size_t i = 0; i < N; i++) {
+          uint64_t v;
+          success &= small_cuckoo_set_find(&set, keys[i], &v) && v == i;
+     }
+     success &= !small_cuckoo_set_find(&set, next_key(&state), NULL);
+     ok(success, "all keys found across shards");
+
+     success = 1;
+     for (size_t i = 0; i < N; i += 2)
+          success &= small_cuckoo_set_erase(&set, keys[i]);
+     for (size_t i = 1; i < N; i += 2)
+          ++*small_cuckoo_set_find_or_insert(&set, keys[i], 0);
+     success &= small_cuckoo_set_size(&set) == N/2;
+     for (size_t i = 0; i < N; i++) {
+          uint64_t v;
+          bool found = small_cuckoo_set_find(&set, keys[i], &v);
+          success &= i % 2 ? found && v == i+1 : !found;
+     }
+     ok(success, "erase and find_or_insert reach the right shard");
+     small_cuckoo_set_free(&set);
+}
+
+void test_full_shard()
+{
+     note(__func__);
+
+     /* One shard, planned for a tenth of what gets inserted. */
+     enum { MAX_KEYS = 10000 };
+     uint64_t state = 2;
+     small_cuckoo_set set = small_cuckoo_set_new(MAX_KEYS, NULL);
+     size_t kept = 0, refused = 0;
+     for (size_t i = 0; i < 10*MAX_KEYS; i++) {
+          keys[i] = next_key(&state);
+          if (small_cuckoo_set_insert(&set, keys[i], i)) ++kept;
+          else ++refused;
+     }
+     note("kept %zu keys, refused %zu", kept, refused);
+     int success = set.n_shards == 1 && kept == SHARD_CAPACITY && refused == 10*MAX_KEYS - kept;
+     success &= small_cuckoo_set_size(&set) == kept;
+     for (size_t i = 0; i < kept; i++) {
+          uint64_t v;
+          success &= small_cuckoo_set_find(&set, keys[i], &v) && v == i;
+     }
+     ok(success, "inserts into a full shard fail rather than abort");
+
+     uint64_t *v = small_cuckoo_set_upsert(&set, keys[0], 42);
+     success = v && *v == 42 && small_cuckoo_set_find_or_insert(&set, keys[1], 0);
+     success &= !small_cuckoo_set_upsert(&set, keys[kept], 1);
+     success &= !small_cuckoo_set_find_or_insert(&set, keys[kept], 1);
+     success &= small_cuckoo_set_erase(&set, keys[0]);
+     success &= small_cuckoo_set_insert(&set, keys[kept], kept);
+     ok(success, "a full shard still updates its keys, and takes new ones once one is erased");
+     small_cuckoo_set_free(&set);
+}
+
+int main()
+{
+     struct {
+          void (*fn)();
+          int count;
+     } tests[] = {
+          {test_many_keys, 3},
+          {test_full_shard, 2},
+     };
+
+     int i, count = 0, n = (sizeof tests)/(sizeof tests[0]);
+     for (i = 0; i < n; i++)
+          count += tests[i].count;
+     plan(count, "small-cuckoo-set");
+     for (i = 0; i < n; i++)
+          tests[i].fn();
+     done_testing();
+}
+
+#endif
@@ -0,0 +1,47 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * Tables of millions of keys made of small_cuckoo shards.  Each key
+ * belongs to one shard, picked by a hash independent of the shards'
+ * own, so every shard keeps its 16-bit indices and slots, and growing
+ * rebuilds one shard rather than everything.
+ * @file small-cuckoo-set.h
+ */
+#pragma once
+
+#include "small-cuckoo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Keys planned for each shard: half of what one can hold, so that
+ * uneven routing never fills one up. */
+enum { SMALL_CUCKOO_SET_SHARD_KEYS = 1<<15 };
+
+typedef struct small_cuckoo_set {
+     size_t n_shards;
+     small_cuckoo *shards;
+     small_cuckoo_allocator allocator; /* All NULL for malloc. */
+} small_cuckoo_set;
+
+/** A set with enough shards for @a max_keys keys, each built with
+ * @a opts.  The shards start empty and grow on their own, but only to
+ * twice SMALL_CUCKOO_SET_SHARD_KEYS less two keys each, so about twice
+ * @a max_keys in all is a hard cap. */
+extern small_cuckoo_set small_cuckoo_set_new(size_t max_keys, const small_cuckoo_opts *opts);
+/** As small_cuckoo_insert, but also false, with nothing inserted, if
+ * the key's shard is full. */
+extern bool small_cuckoo_set_insert(small_cuckoo_set *set, uint64_t key, uint64_t value);
+/** As small_cuckoo_find_or_insert and small_cuckoo_upsert, but also
+ * NULL, with nothing inserted, if @a key is missing and its shard is
+ * full. */
+extern uint64_t *small_cuckoo_set_find_or_insert(small_cuckoo_set *set, uint64_t key, uint64_t value);
+extern uint64_t *small_cuckoo_set_upsert(small_cuckoo_set *set, uint64_t key, uint64_t value);
+extern bool small_cuckoo_set_find(small_cuckoo_set *set, uint64_t key, uint64_t *value);
+extern bool small_cuckoo_set_erase(small_cuckoo_set *set, uint64_t key);
+/** Keys in all shards; takes time in proportion to the shard count. */
+extern size_t small_cuckoo_set_size(const small_cuckoo_set *set);
+extern void small_cuckoo_set_free(small_cuckoo_set *set);
+
+#ifdef __cplusplus
+}
+#endif
@@ -11,10 +11,30 @@
 #include "ensure.h"
 #include "bithacks.h"
 
+#include <sys/mman.h>
+
+/* Entries are numbered with 16 bits, or 32 when small-cuckoo32.c
+ * builds this file again with SMALL_CUCKOO_WIDE. */
+#ifdef SMALL_CUCKOO_WIDE
+typedef uint32_t entry_index;
+#define MAX_ENTRIES UINT32_MAX
+#define htole_index htole32
+#define le_index_toh le32toh
+#else
+typedef uint16_t entry_index;
+#define MAX_ENTRIES UINT16_MAX
+#define htole_index htole16
+#define le_index_toh le16toh
+#endif
+enum { INDEX_BITS = 8 * sizeof(entry_index) };
+
 /* Larson's hash function.
  * Described in Per-Ake Larson, Dynamic Hash Tables, CACM 31(4), April 1988, pp. 446--457.
- * Acceptable according to <http://www.strchr.com/hash_functions>. */
-uint16_t larsons_hash(uint64_t key)
+ * Acceptable according to <http://www.strchr.com/hash_functions>.
+ * The last bytes read only reach the low bits of @c h, and slots are
+ * picked from the high bits, so it ends with a multiply by 2^32/phi
+ * that carries every bit upwards. */
+uint32_t larsons_hash(uint64_t key)
 {
      uint32_t h = 0xdeadbeef;
      uint8_t *s = (uint8_t *)&key;
@@ -26,31 +46,71 @@ uint16_t larsons_hash(uint64_t key)
      h = h * M + *s++;
      h = h * M + *s++;
      h = h * M + *s++;
-     return h ^ (h>>16);
+     h = h * M + *s++;
+     return h * 0x9e3779b1u;
+}
+
+/* Both hashes below are linear enough that perturbing their initial
+ * state would leave exactly the same keys colliding.  Instead a seed
+ * multiplies the key by an odd constant first: a bijection, so
+ * distinct keys stay distinct, which reshuffles who collides with
+ * whom.  Seed 0 leaves keys untouched. */
+static inline uint64_t seeded(uint64_t key, uint32_t seed)
+{
+     return key * (2*(uint64_t)seed + 1);
+}
+
+/* Lemire's multiply-shift range reduction: a 32-bit hash to [0, n)
+ * without a division, for any @a n, using the hash's high bits. */
+static inline size_t fastrange(uint32_t h, size_t n)
+{
+     return ((uint64_t)h * n) >> 32;
+}
+
+/* Map a 32-bit hash to the even (hash_1) or odd (hash_2) slots of a
+ * table of @a n slots. */
+static inline size_t reduce(size_t n, uint32_t h, unsigned choice)
+{
+     return choice + (fastrange(h, n>>1)<<1);
+}
+
+/* The same for tables of @a ways choices per key: slot @a choice of
+ * one of @a rows rows of @a ways slots. */
+static inline size_t reduce_row(size_t rows, unsigned ways, uint32_t h, unsigned choice)
+{
+     return choice + fastrange(h, rows) * ways;
+}
+
+/* Rows in a table of @a n slots. */
+static inline size_t n_rows(size_t n, unsigned ways)
+{
+     return ways == 3 ? n/3 : n >> (ways>>1);
 }
 
-static uint16_t hash_1(size_t n, uint64_t key)
+static uint32_t raw_hash_1(uint32_t seed, uint64_t key)
 {
-     return (larsons_hash(key) & ((n>>1)-1))<<1;
+     return larsons_hash(seeded(key, seed));
 }
 
 /* Use CRC32 if we have it in hardware, Bob Jenkins's stuff otherwise.
- * Acceptable according to <http://www.strchr.com/hash_functions>. */
+ * Acceptable according to <http://www.strchr.com/hash_functions>.
+ * Builds without -msse4.2 still get CRC32 on CPUs that have it; see
+ * HAVE_CRC32_DISPATCH below. */
 #ifdef __SSE4_2__
 
 #include <x86intrin.h>
 
-static uint16_t hash_2(size_t n, uint64_t key)
+static uint32_t raw_hash_2(uint32_t seed, uint64_t key)
 {
      uint32_t h;
+     key = seeded(key, seed);
 #ifdef __x86_64__
      h = _mm_crc32_u64(-1, key);
 #else
      h = _mm_crc32_u32(-1, ((uint32_t*)&key)[0]);
      h = _mm_crc32_u32(h, ((uint32_t*)&key)[1]);
 #endif
-     h ^= (h>>16);
-     return 1 + ((h & ((n>>1)-1))<<1);
+     return h;
 }
 
 #else
@@ -111,306 +171,2786 @@ uint32_t        initval)         /* the previous hash, or an arbitrary value */
      return c;
 }
 
-static uint16_t hash_2(size_t n, uint64_t key)
+static uint32_t raw_hash_2(uint32_t seed, uint64_t key)
 {
-     uint32_t h;
-     h = hashword((const uint32_t *)&key, 2, 0x55555555);
-     h ^= (h>>16);
-     return 1 + ((h & ((n>>1)-1))<<1);
+     uint32_t k[2];
+     key = seeded(key, seed);
+     memcpy(k, &key, sizeof k);
+     return hashword(k, 2, 0x55555555);
+}
+
+/* Generic x86-64 builds carry a CRC32 variant of the pair too, and
+ * small_cuckoo_new picks it when cpuid says SSE 4.2 is there.  The
+ * choice is made once per table and kept in sc->hash, so a table never
+ * mixes the two; files only hold entries and the table is rebuilt on
+ * load, so they stay compatible between hosts either way. */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC32_DISPATCH 1
+
+#include <x86intrin.h>
+
+static uint32_t raw_hash_1(uint32_t seed, uint64_t key);
+
+__attribute__((target("sse4.2")))
+static uint64_t larson_crc32_hash(uint64_t key, uint32_t seed)
+{
+     uint32_t h = _mm_crc32_u64(-1, seeded(key, seed));
+     return (uint64_t)h<<32 | raw_hash_1(seed, key);
+}
+
+static bool have_crc32(void)
+{
+     static int have = -1;
+     int h = __atomic_load_n(&have, __ATOMIC_RELAXED);
+     if (h < 0) {
+          __builtin_cpu_init();
+          h = __builtin_cpu_supports("sse4.2");
+          __atomic_store_n(&have, h, __ATOMIC_RELAXED);
+     }
+     return h;
 }
 
 #endif
 
+#endif
 
-small_cuckoo small_cuckoo_new(size_t initial_size)
+/* The hash pair for tables given none: NULL means the compiled-in
+ * raw_hash_1/raw_hash_2. */
+static small_cuckoo_hash_fn *default_hash_fn(void)
 {
-     small_cuckoo sc = {0};
-     sc.table_size = 1<<(ceil_pow2(initial_size)+1);
-     ENSURE(sc.table = calloc(sc.table_size, sizeof sc.table[0]));
-     sc.n_entries = 1;          /* Entry 0 is special. */
-     sc.entries_len = 1+initial_size;
-     ENSURE(sc.entries = malloc(sc.entries_len * sizeof sc.entries[0]));
-     return sc;
+#ifdef HAVE_CRC32_DISPATCH
+     if (have_crc32()) return larson_crc32_hash;
+#endif
+     return NULL;
+}
+
+/* Whether hash_1 of @a sc is Larson's hash, as the SIMD kernels assume. */
+static inline bool larson_hash_1(const small_cuckoo *sc)
+{
+#ifdef HAVE_CRC32_DISPATCH
+     if (sc->hash == larson_crc32_hash) return true;
+#endif
+     return !sc->hash;
 }
 
-static void insert(small_cuckoo *sc, uint16_t i);
+static inline size_t hash_1(size_t n, uint32_t seed, uint64_t key)
+{
+     return reduce(n, raw_hash_1(seed, key), 0);
+}
 
-static void double_size(small_cuckoo *sc)
+static inline size_t hash_2(size_t n, uint32_t seed, uint64_t key)
 {
-     uint16_t *prev_table = sc->table;
-     sc->table_size <<= 1;
-     ENSURE(sc->table = calloc(sc->table_size, sizeof sc->table[0]));
-     for (unsigned i = 0; i < sc->table_size>>1; ++i) {
-          uint16_t k = prev_table[i];
-          if (k) insert(sc, k);
-     }
-     free(prev_table);
+     return reduce(n, raw_hash_2(seed, key), 1);
 }
 
-enum { MAX_LOOPS = 20 };
+/* The wide build shares these with the narrow one. */
+#ifndef SMALL_CUCKOO_WIDE
+const char SMALL_CUCKOO_LAYOUT = 0;
 
-static void insert(small_cuckoo *sc, uint16_t i)
+uint64_t small_cuckoo_default_hash(uint64_t key, uint32_t seed)
 {
-     uint16_t h;
-     for (size_t n = MAX_LOOPS; n > 0; --n) {
-#define X(fn)                                                  \
-          h = fn(sc->table_size, sc->entries[i].key);          \
-          i ^= sc->table[h];                                   \
-          sc->table[h] ^= i;                                   \
-          i ^= sc->table[h];                                   \
-          if (i == 0) return;
+     small_cuckoo_hash_fn *fn = default_hash_fn();
+     if (fn) return fn(key, seed);
+     return (uint64_t)raw_hash_2(seed, key)<<32 | raw_hash_1(seed, key);
+}
+#endif
 
-          X(hash_1);
-          X(hash_2);
-#undef X
-     }
+/* One strong 64-bit hash, MurmurHash3's finalizer, whose halves
+ * serve as both cuckoo hashes.  Three multiplies against the seven
+ * serial multiply-adds of Larson's hash plus a second hash. */
+static inline uint64_t split_hash(uint64_t key, uint32_t seed)
+{
+     uint64_t h = seeded(key, seed);
+     h ^= h>>33;
+     h *= 0xff51afd7ed558ccdULL;
+     h ^= h>>33;
+     h *= 0xc4ceb9fe1a85ec53ULL;
+     return h ^ (h>>33);
+}
 
-     double_size(sc);
-     insert(sc, i);
+#ifndef SMALL_CUCKOO_WIDE
+uint64_t small_cuckoo_split_hash(uint64_t key, uint32_t seed)
+{
+     return split_hash(key, seed);
 }
+#endif
 
-void small_cuckoo_insert(small_cuckoo *sc, uint64_t key, uint64_t value)
+/* The table's own hash pair; the split hash is common enough to be
+ * worth inlining rather than calling through the pointer. */
+static inline uint64_t pair_hash(const small_cuckoo *sc, uint32_t seed, uint64_t key)
 {
-     uint16_t i = sc->n_entries;
-     ENSURE(i > 0);
-     ++sc->n_entries;
-     if (sc->n_entries >= sc->entries_len) {
-          sc->entries_len <<= 1;
-          ENSURE(sc->entries = realloc(sc->entries, sc->entries_len * sizeof sc->entries[0]));
-     }
-     sc->entries[i].key = key;
-     sc->entries[i].value = value;
-     insert(sc, i);
+     if (sc->hash == small_cuckoo_split_hash) return split_hash(key, seed);
+#ifdef HAVE_CRC32_DISPATCH
+     if (sc->hash == larson_crc32_hash) return larson_crc32_hash(key, seed);
+#endif
+     return sc->hash(key, seed);
 }
 
-bool small_cuckoo_find(small_cuckoo *sc, uint64_t key, uint64_t *value)
+enum { MAX_WAYS = 4 };
+
+/* Slots for the hash pair @a a, @a b in a table of @a n slots.
+ * Choices past the second come from double hashing, a + c*b, which
+ * is as good as independent hashes for cuckoo hashing (Mitzenmacher
+ * and Thaler, 2012) and costs no more hashing. */
+static inline void slots_of_pair(size_t n, unsigned ways, uint32_t a, uint32_t b, size_t h[MAX_WAYS])
 {
-     uint16_t i;
-#define X(h)                                            \
-     i = sc->table[h];                                  \
-     if (i && sc->entries[i].key == key) {              \
-          if (value) *value= sc->entries[i].value;      \
-          return true;                                  \
+     if (ways == 2) {
+          h[0] = reduce(n, a, 0);
+          h[1] = reduce(n, b, 1);
+          return;
      }
-     X(hash_1(sc->table_size, key));
-     X(hash_2(sc->table_size, key));
-     return false;
-#undef X
+     size_t rows = n_rows(n, ways);
+     h[0] = reduce_row(rows, ways, a, 0);
+     h[1] = reduce_row(rows, ways, b, 1);
+     for (unsigned c = 2; c < ways; ++c)
+          h[c] = reduce_row(rows, ways, a + c*b, c);
 }
 
-void small_cuckoo_free(small_cuckoo *sc)
+/* The hash pair of @a key under @a seed, built-in or not. */
+static inline uint64_t full_hash(const small_cuckoo *sc, uint32_t seed, uint64_t key)
 {
-     if (sc->table) free(sc->table);
-     if (sc->entries) free(sc->entries);
-     *sc = (small_cuckoo){0};
+     if (sc->hash) return pair_hash(sc, seed, key);
+     return (uint64_t)raw_hash_2(seed, key)<<32 | raw_hash_1(seed, key);
 }
 
-/* We only write out the entries, not the table; it gets reconstructed
- * when we read the metadata.
- */
-void small_cuckoo_serialize(int fd, small_cuckoo *sc)
+/* All slots for @a key in a table of @a n slots hashed with @a seed;
+ * the old table of an incremental resize differs from @a sc's own. */
+static inline void slots_in(const small_cuckoo *sc, size_t n, uint32_t seed, uint64_t key, size_t h[MAX_WAYS])
 {
-#define WRITE_UNDER(t,x,n) do { uint32_t u = t(x); ENSURE(n == write(fd, &u, n)); } while(0)
-     WRITE_UNDER(htole16, sc->n_entries, 2);
-     for (uint16_t i = 0; i < sc->n_entries; ++i) {
-          WRITE_UNDER(htole64, sc->entries[i].key, 8);
-          WRITE_UNDER(htole64, sc->entries[i].value, 8);
-     }
-#undef WRITE_UNDER
+     uint64_t pair = full_hash(sc, seed, key);
+     slots_of_pair(n, sc->ways, pair, pair>>32, h);
 }
 
-void small_cuckoo_deserialize(int fd, small_cuckoo *sc)
+static inline void slots(const small_cuckoo *sc, uint64_t key, size_t h[MAX_WAYS])
 {
-     *sc = (small_cuckoo){0};
-#define READ(v,n) ENSURE(n == read(fd, v, n))
-#define READ_AND(then,v,n) do { uint32_t u = 0; READ(&u,n); v = then(u); } while(0)
-     READ_AND(le16toh, sc->n_entries, 2);
-     sc->table_size = 1<<(ceil_pow2(sc->n_entries)+1);
-     ENSURE(sc->table = malloc(sc->table_size * sizeof sc->table[0]));
-     ENSURE(sc->entries = malloc(sc->n_entries * sizeof sc->entries[0]));
-     for (uint16_t i = 0; i < sc->n_entries; ++i) {
-          READ_AND(le64toh, sc->entries[i].key, 8);
-          READ_AND(le64toh, sc->entries[i].value, 8);
-     }
-#undef READ_AND
-#undef READ
+     slots_in(sc, sc->table_size, sc->seed, key, h);
+}
 
-     for (uint16_t i = 0; i < sc->n_entries; ++i)
-          insert(sc, i);
+/* Slots of entry @a i, from its cached hash pair if there is one. */
+static inline void entry_slots(const small_cuckoo *sc, entry_index i, size_t h[MAX_WAYS])
+{
+     if (sc->hashes) slots_of_pair(sc->table_size, sc->ways, sc->hashes[i], sc->hashes[i]>>32, h);
+     else slots(sc, sc->entries[i].key, h);
 }
 
-void small_cuckoo_iterate(small_cuckoo *sc, small_cuckoo_iter *iter)
+/* Fill in the cached hash pairs of every entry under the current seed. */
+static void hash_entries(small_cuckoo *sc)
 {
-     *iter = (small_cuckoo_iter){ .sc = sc, .i = 0 };
+     for (entry_index i = 1; i < sc->n_entries; ++i)
+          sc->hashes[i] = full_hash(sc, sc->seed, sc->entries[i].key);
 }
 
-bool small_cuckoo_iter_has_next(small_cuckoo_iter *iter)
+/* Bring the cached hash pair of entry @a i up to the current seed. */
+static inline void rehash_entry(small_cuckoo *sc, entry_index i)
 {
-     for (; iter->i < iter->sc->table_size; ++iter->i) {
-          if (iter->sc->table[iter->i]) return true;
-     }
-     return false;
+     if (sc->hashes) sc->hashes[i] = full_hash(sc, sc->seed, sc->entries[i].key);
 }
 
-extern void small_cuckoo_iter_next(small_cuckoo_iter *iter, uint64_t *key, uint64_t *value)
+/* With SMALL_CUCKOO_FINGERPRINT, each slot carries 16 bits of a hash
+ * independent of hash_1 and hash_2 next to the entry index, so a
+ * lookup only dereferences entries[] for a candidate whose tag
+ * matches; most misses never leave the table. */
+#ifdef SMALL_CUCKOO_FINGERPRINT
+
+static inline uint16_t fingerprint(uint64_t key)
 {
-     for (; iter->i < iter->sc->table_size; ++iter->i) {
-          uint16_t j = iter->sc->table[iter->i];
-          if (j) {
-               if (key) *key = iter->sc->entries[j].key;
-               if (value) *value = iter->sc->entries[j].value;
-               ++iter->i;
-               return;
-          }
-     }
-     ENSURE(false);
+     return (key * 0x9e3779b97f4a7c15ULL) >> 48;
 }
 
+static inline small_cuckoo_slot make_slot(entry_index i, uint64_t key)
+{
+     return i | (small_cuckoo_slot)fingerprint(key) << INDEX_BITS;
+}
 
-#ifdef UNIT_TEST
+static inline entry_index slot_entry(small_cuckoo_slot s) { return s; }
+static inline bool slot_may_hold(small_cuckoo_slot s, uint16_t tag) { return s>>INDEX_BITS == tag; }
 
-#include <tap.h>
-#include <time.h>
+#else
 
-/* Fowler-Noll-Vo hash, per http://isthe.com/chongo/tech/comp/fnv/ */
-static uint64_t fnv_hash(uint8_t *data, size_t n)
+static inline uint16_t fingerprint(uint64_t key) { (void)key; return 0; }
+static inline small_cuckoo_slot make_slot(entry_index i, uint64_t key) { (void)key; return i; }
+static inline entry_index slot_entry(small_cuckoo_slot s) { return s; }
+static inline bool slot_may_hold(small_cuckoo_slot s, uint16_t tag) { (void)s; (void)tag; return true; }
+
+#endif
+
+
+/* The load past which insertions start failing in earnest: 1/2 with
+ * two choices, about 0.91 with three and 0.97 with four. */
+static double threshold_for(unsigned ways)
 {
-     uint64_t h = 14695981039346656037ULL;
-     for (; n > 0; ++data, --n) {
-          h ^= *data;
-          h += (h<<1) + (h<<4) + (h<<5) + (h<<7) + (h<<8) + (h<<40); /* alternately: h *= 1099511628211ULL; */
-     }
-     return h;
+     static const double threshold[MAX_WAYS+1] = { [2] = 0.5, [3] = 0.91, [4] = 0.97 };
+     return threshold[ways];
 }
 
-/* The idea for this equation comes from section 7.6 of Aho, Sethi,
- * and Ullmann; Compilers: Principles, Techniques, and Tools (2002).
- */
-static double evaluate_hash_quality(uint64_t *b, size_t n)
+/* The smallest table with room for @a n_keys at @a load of the way to
+ * the load threshold. */
+static size_t table_size_at(size_t n_keys, unsigned ways, double load)
 {
-     double sum = 0.0;
-     for (size_t j = 0; j < n; ++j) {
-          sum += (b[j] * (b[j]+1.0)/2.0);
-     }
-     return sum/(1.5*(double)n-.5);
+     double exact = n_keys / (load * threshold_for(ways) * ways);
+     size_t rows = exact;
+     if (rows < exact) ++rows;
+     return (rows ? rows : 1) * ways;
 }
 
-void test_basic_ops_randomized()
+/* Tables grow by half again rather than doubling, so a table that has
+ * just grown is still at two thirds of its old load rather than half. */
+static size_t grown(size_t table_size, unsigned ways)
 {
-     int t = time(NULL);
-     note("%s: seed %d", __func__, t);
-     srand(t);
+     size_t rows = table_size / ways;
+     return (rows + (rows > 1 ? rows/2 : 1)) * ways;
+}
 
-     /* Note: should be a power of two for hash quality tests. */
-     enum { TEST_BASIC_N_ELEMENTS = 1024 };
-     uint64_t keys[TEST_BASIC_N_ELEMENTS] = {0};
-     uint64_t values[TEST_BASIC_N_ELEMENTS] = {0};
-     uint64_t hash_quality_test[2][TEST_BASIC_N_ELEMENTS] = {{0},{0}};
+/* The allocator behind SMALL_CUCKOO_HUGE_PAGES, SMALL_CUCKOO_PREFAULT
+ * and SMALL_CUCKOO_MLOCK, whose context is the table's flags.  Small
+ * blocks come from calloc; the rest are mapped, rounded up to pages
+ * or, with huge pages, to aligned 2MB pages so the kernel can back
+ * every one of them with a single TLB entry.  Either way they come
+ * back zeroed.  The sizes given to free and realloc tell us which
+ * kind of block we had. */
+enum { MAP_THRESHOLD = 64<<10, HUGE_PAGE_SIZE = 2<<20 };
 
-     small_cuckoo sc;
-     sc = small_cuckoo_new(0);
-     for (int i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
-          keys[i] = rand();
-          keys[i] = fnv_hash((uint8_t *)&keys[i], 8);
-          values[i] = rand();
-          small_cuckoo_insert(&sc, keys[i], values[i]);
-          int n = TEST_BASIC_N_ELEMENTS;
-          ++hash_quality_test[0][hash_1(n<<1, keys[i])>>1];
-          ++hash_quality_test[1][hash_2(n<<1, keys[i])>>1];
-     }
+static size_t mapped_size(unsigned flags, size_t size)
+{
+     size_t page = flags & SMALL_CUCKOO_HUGE_PAGES ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+     return (size + page-1) & ~(page-1);
+}
 
-     int success = 1;
-     for (int i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
-          uint64_t v;
-          success &= small_cuckoo_find(&sc, keys[i], &v);
-          success &= v == values[i];
+static void *mapped_alloc(void *ctx, size_t size)
+{
+     unsigned flags = (uintptr_t)ctx;
+     if (size < MAP_THRESHOLD) return calloc(1, size);
+     size_t len = mapped_size(flags, size);
+     size_t slack = flags & SMALL_CUCKOO_HUGE_PAGES ? HUGE_PAGE_SIZE : 0;
+     char *p = mmap(NULL, len + slack, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+     if (p == MAP_FAILED) return NULL;
+     if (slack) {
+          /* Trim the extra huge page's worth to an aligned block. */
+          size_t head = -(uintptr_t)p & (HUGE_PAGE_SIZE-1);
+          if (head) munmap(p, head);
+          munmap(p + head + len, slack - head);
+          p += head;
+#ifdef MADV_HUGEPAGE
+          madvise(p, len, MADV_HUGEPAGE);
+#endif
      }
-     ok(success, "all keys found and values match");
-
-     small_cuckoo_iter iter;
-     small_cuckoo_iterate(&sc, &iter);
-     success = 1;
-     while (small_cuckoo_iter_has_next(&iter) && success) {
-          uint64_t k, v;
-          small_cuckoo_iter_next(&iter, &k, &v);
-          int i;
-          for (i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
-               if (k == keys[i]) {
-                    success &= v == values[i];
-                    keys[i] = 0;
-                    break;
-               }
-          }
-          if (i == TEST_BASIC_N_ELEMENTS) success = 0;
+     if (flags & SMALL_CUCKOO_PREFAULT) {
+          size_t page = sysconf(_SC_PAGESIZE);
+          for (size_t i = 0; i < len; i += page)
+               ((volatile char *)p)[i] = 0;
      }
-     ok(success, "iterator finds all entries inserted");
+     if (flags & SMALL_CUCKOO_MLOCK)
+          (void)mlock(p, len);
+     return p;
+}
 
-     small_cuckoo_free(&sc);
+static void mapped_free(void *ctx, void *p, size_t size)
+{
+     if (size < MAP_THRESHOLD) free(p);
+     else munmap(p, mapped_size((uintptr_t)ctx, size));
+}
 
-     for (int i = 0; i < 2; ++i) {
-          double quality = evaluate_hash_quality(hash_quality_test[i], TEST_BASIC_N_ELEMENTS);
-          note("estimated quality of hash %d is %f\n", i+1, quality);
-          /* Quality below 0.5 would be great but should be
-           * impossible, so we put that test in to catch testing
-           * errors. */
-          ok(quality > 0.5 && quality < 1.05, "hash quality acceptable");
-     }
+static void *mapped_realloc(void *ctx, void *p, size_t old_size, size_t new_size)
+{
+     if (old_size < MAP_THRESHOLD && new_size < MAP_THRESHOLD)
+          return realloc(p, new_size);
+     if (old_size >= MAP_THRESHOLD && new_size >= MAP_THRESHOLD &&
+         mapped_size((uintptr_t)ctx, old_size) == mapped_size((uintptr_t)ctx, new_size))
+          return p;
+     void *q = mapped_alloc(ctx, new_size);
+     if (!q) return NULL;
+     memcpy(q, p, old_size < new_size ? old_size : new_size);
+     mapped_free(ctx, p, old_size);
+     return q;
 }
 
-void test_basic_ops_incremental()
+enum { MAPPED_FLAGS = SMALL_CUCKOO_HUGE_PAGES | SMALL_CUCKOO_PREFAULT | SMALL_CUCKOO_MLOCK };
+
+/* Every block the table owns comes from these, through the allocator
+ * given at construction if there was one. */
+static void *allocate(const small_cuckoo *sc, size_t size)
 {
-     note(__func__);
+     const small_cuckoo_allocator *a = &sc->allocator;
+     return a->alloc ? a->alloc(a->ctx, size) : malloc(size);
+}
 
-     /* Note: should be a power of two for hash quality tests. */
-     enum { TEST_BASIC_N_ELEMENTS = 1024 };
-     uint64_t hash_quality_test[2][TEST_BASIC_N_ELEMENTS] = {{0},{0}};
+static void *allocate_zeroed(const small_cuckoo *sc, size_t size)
+{
+     const small_cuckoo_allocator *a = &sc->allocator;
+     if (!a->alloc) return calloc(1, size);
+     void *p = a->alloc(a->ctx, size);
+     /* Clearing a fresh mapping would fault in every page of it. */
+     if (p && a->alloc != mapped_alloc) memset(p, 0, size);
+     return p;
+}
 
-     small_cuckoo sc;
-     sc = small_cuckoo_new(0);
-     for (int i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
-          small_cuckoo_insert(&sc, i, i);
-          int n = TEST_BASIC_N_ELEMENTS;
-          ++hash_quality_test[0][hash_1(n<<1, i)>>1];
-          ++hash_quality_test[1][hash_2(n<<1, i)>>1];
-     }
+static void *reallocate(const small_cuckoo *sc, void *p, size_t old_size, size_t new_size)
+{
+     const small_cuckoo_allocator *a = &sc->allocator;
+     return a->realloc ? a->realloc(a->ctx, p, old_size, new_size) : realloc(p, new_size);
+}
 
-     int success = 1;
-     for (uint32_t i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
-          uint64_t v;
-          success &= small_cuckoo_find(&sc, i, &v);
-          success &= v == i;
+static void deallocate(const small_cuckoo *sc, void *p, size_t size)
+{
+     const small_cuckoo_allocator *a = &sc->allocator;
+     if (!p) return;
+     if (a->free) a->free(a->ctx, p, size);
+     else free(p);
+}
+
+/* Readers of a SMALL_CUCKOO_CONCURRENT table may still be probing an
+ * array after the writer has replaced it, so it goes on this list
+ * until small_cuckoo_reclaim rather than straight back. */
+struct small_cuckoo_retired {
+     void *p;
+     size_t size;
+     struct small_cuckoo_retired *next;
+};
+
+/* Give back @a p, which readers may have seen. */
+static void release(small_cuckoo *sc, void *p, size_t size)
+{
+     if (!p || !(sc->flags & SMALL_CUCKOO_CONCURRENT)) {
+          deallocate(sc, p, size);
+          return;
      }
-     ok(success, "all keys found and values match");
+     struct small_cuckoo_retired *r;
+     ENSURE(r = allocate(sc, sizeof *r));
+     *r = (struct small_cuckoo_retired){ p, size, sc->retired };
+     sc->retired = r;
+}
 
-     small_cuckoo_iter iter;
-     small_cuckoo_iterate(&sc, &iter);
-     success = 1;
-     while (small_cuckoo_iter_has_next(&iter) && success) {
-          uint64_t k, v;
-          small_cuckoo_iter_next(&iter, &k, &v);
+static void free_retired(small_cuckoo *sc, struct small_cuckoo_retired *r)
+{
+     while (r) {
+          struct small_cuckoo_retired *next = r->next;
+          deallocate(sc, r->p, r->size);
+          deallocate(sc, r, sizeof *r);
+          r = next;
      }
-     ok(success, "iterator finds all entries inserted");
+}
 
-     small_cuckoo_free(&sc);
+/* A lookup begun before the previous call may have found an array
+ * retired since, so only those retired before it can go. */
+void small_cuckoo_reclaim(small_cuckoo *sc)
+{
+     free_retired(sc, sc->retired_before);
+     sc->retired_before = sc->retired;
+     sc->retired = NULL;
+}
 
-     for (int i = 0; i < 2; ++i) {
-          double quality = evaluate_hash_quality(hash_quality_test[i], TEST_BASIC_N_ELEMENTS);
-          note("estimated quality of hash %d is %f\n", i+1, quality);
-          /* Quality below 0.5 would be great but should be
-           * impossible, so we put that test in to catch testing
-           * errors. */
-          ok(quality > 0.5 && quality < 1.05, "hash quality acceptable");
-     }
+/* The writer's side of the seqlock: @c version is odd from
+ * write_begin to write_end, and the fences keep its changes inside.
+ * Tables without SMALL_CUCKOO_CONCURRENT skip it. */
+static inline void write_begin(small_cuckoo *sc)
+{
+     if (!(sc->flags & SMALL_CUCKOO_CONCURRENT)) return;
+     __atomic_store_n(&sc->version, sc->version + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-int main()
+static inline void write_end(small_cuckoo *sc)
 {
-     struct {
-          void (*fn)();
-          int count;
-     } tests[] = {
-          {test_basic_ops_randomized, 4},
-          {test_basic_ops_incremental, 4}
+     if (!(sc->flags & SMALL_CUCKOO_CONCURRENT)) return;
+     __atomic_store_n(&sc->version, sc->version + 1, __ATOMIC_RELEASE);
+}
+
+/* What readers may load while the writer stores it (slots, entries,
+ * and the fields a lookup snapshots) is stored whole: relaxed, the
+ * seqlock ordering the rest.  New arrays are published with release,
+ * so what went into them beforehand is there for readers that find
+ * them.  On x86 both are plain moves. */
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define PUBLISH(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+small_cuckoo small_cuckoo_new(size_t initial_size)
+{
+     return small_cuckoo_new_opts(initial_size, NULL);
+}
+
+/* Set up everything @a opts decides in an empty table. */
+static void apply_opts(small_cuckoo *sc, const small_cuckoo_opts *opts)
+{
+     sc->hash = opts && opts->hash ? opts->hash : default_hash_fn();
+     sc->flags = opts ? opts->flags : 0;
+     sc->ways = opts && opts->ways ? opts->ways : 2;
+     ENSURE(sc->ways >= 2 && sc->ways <= MAX_WAYS);
+     if (opts && opts->allocator) {
+          ENSURE(!(sc->flags & MAPPED_FLAGS));
+          sc->allocator = *opts->allocator;
+          ENSURE(sc->allocator.alloc && sc->allocator.realloc && sc->allocator.free);
+     } else if (sc->flags & MAPPED_FLAGS)
+          sc->allocator = (small_cuckoo_allocator){
+               mapped_alloc, mapped_realloc, mapped_free, (void *)(uintptr_t)sc->flags
+          };
+}
+
+small_cuckoo small_cuckoo_new_opts(size_t initial_size, const small_cuckoo_opts *opts)
+{
+     small_cuckoo sc = {0};
+     apply_opts(&sc, opts);
+     sc.table_size = table_size_at(initial_size, sc.ways, 0.9);
+     ENSURE(sc.table = allocate_zeroed(&sc, sc.table_size * sizeof sc.table[0]));
+     sc.n_entries = 1;          /* Entry 0 is special. */
+     sc.entries_len = 1+initial_size;
+     ENSURE(sc.entries = allocate(&sc, sc.entries_len * sizeof sc.entries[0]));
+     /* Never a real entry, but the SIMD kernels read it for empty slots. */
+     sc.entries[0].key = sc.entries[0].value = 0;
+     if (sc.flags & SMALL_CUCKOO_CACHE_HASHES)
+          ENSURE(sc.hashes = allocate(&sc, sc.entries_len * sizeof sc.hashes[0]));
+     return sc;
+}
+
+#ifdef SMALL_CUCKOO_STATS
+#ifndef SMALL_CUCKOO_WIDE
+struct small_cuckoo_stats small_cuckoo_stats;
+#endif
+
+static inline void count_path(unsigned moves)
+{
+     ++small_cuckoo_stats.placements;
+     small_cuckoo_stats.moves += moves;
+     if (moves > small_cuckoo_stats.max_moves) small_cuckoo_stats.max_moves = moves;
+}
+#else
+static inline void count_path(unsigned moves) { (void)moves; }
+#endif
+
+/* Enough for chains of 60-odd displacements from each of the two
+ * slots, more than the old random walk's 40 moves in total. */
+enum { MAX_BFS_NODES = 128 };
+
+/* Put @a s, whose slots are @a h, in the table by the shortest chain
+ * of displacements, found by breadth-first search over "the occupant
+ * of this slot could move to that one" before anything is moved.
+ * Returns 0 on success, otherwise @a s, with the table untouched.
+ * @a h is overwritten. */
+static small_cuckoo_slot place_at(small_cuckoo *sc, small_cuckoo_slot s, size_t h[MAX_WAYS])
+{
+     struct { size_t slot; int parent; } node[MAX_BFS_NODES];
+     int n = 0;
+     for (int j = 0; j < sc->ways; ++j) {
+          if (!sc->table[h[j]]) {
+               STORE(sc->table[h[j]], s);
+               count_path(1);
+               return 0;
+          }
+          node[n].slot = h[j];
+          node[n++].parent = -1;
+     }
+
+     for (int k = 0; k < n; ++k) {
+          size_t p = node[k].slot;
+          entry_slots(sc, slot_entry(sc->table[p]), h);
+
+          for (unsigned c = 0; c < sc->ways; ++c) {
+               size_t q = h[c];
+               if (q == p) continue;
+               if (!sc->table[q]) {
+                    unsigned moves = 1;
+                    for (int at = k; at >= 0; at = node[at].parent, ++moves) {
+                         STORE(sc->table[q], sc->table[node[at].slot]);
+                         q = node[at].slot;
+                    }
+                    STORE(sc->table[q], s);
+                    count_path(moves);
+                    return 0;
+               }
+
+               if (n == MAX_BFS_NODES) continue;
+               bool seen = false;
+               for (int j = 0; j < n && !seen; ++j)
+                    seen = node[j].slot == q;
+               if (seen) continue;
+               node[n].slot = q;
+               node[n++].parent = k;
+          }
+     }
+     return s;
+}
+
+static small_cuckoo_slot place(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     size_t h[MAX_WAYS];
+     entry_slots(sc, slot_entry(s), h);
+     return place_at(sc, s, h);
+}
+
+/* Stash @a s if there is room. */
+static bool stash(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     if (sc->n_stashed == SMALL_CUCKOO_STASH_SIZE) return false;
+     STORE(sc->stash[sc->n_stashed], s);
+     STORE(sc->n_stashed, sc->n_stashed + 1);
+     return true;
+}
+
+/* Put back what rebuild() changed, as @a prev had it. */
+static void restore(small_cuckoo *sc, const small_cuckoo *prev)
+{
+     PUBLISH(sc->table, prev->table);
+     STORE(sc->table_size, prev->table_size);
+     STORE(sc->seed, prev->seed);
+     for (unsigned j = 0; j < SMALL_CUCKOO_STASH_SIZE; ++j)
+          STORE(sc->stash[j], prev->stash[j]);
+     STORE(sc->n_stashed, prev->n_stashed);
+     STORE(sc->queue_head, prev->queue_head);
+     STORE(sc->n_queued, prev->n_queued);
+     sc->walk_len = prev->walk_len;
+     sc->hashes = prev->hashes;
+}
+
+/* Place every entry afresh in a table of @a table_size slots hashed
+ * with @a seed.  On failure, leaves the old table untouched. */
+static bool rebuild(small_cuckoo *sc, size_t table_size, uint32_t seed)
+{
+     small_cuckoo prev = *sc;
+     STORE(sc->table_size, table_size);
+     STORE(sc->seed, seed);
+     /* Entries still in a reseeded old table have stale hashes. */
+     bool stale = prev.old_table && prev.old_seed != prev.seed;
+     if (sc->hashes && (seed != prev.seed || stale)) {
+          ENSURE(sc->hashes = allocate(sc, sc->entries_len * sizeof sc->hashes[0]));
+          hash_entries(sc);
+     }
+     STORE(sc->n_stashed, 0);
+     STORE(sc->n_queued, 0);
+     STORE(sc->queue_head, 0);
+     sc->walk_len = 0;
+     small_cuckoo_slot *table;
+     ENSURE(table = allocate_zeroed(sc, table_size * sizeof table[0]));
+     PUBLISH(sc->table, table);
+     for (entry_index i = 1; i < sc->n_entries; ++i) {
+          small_cuckoo_slot s = place(sc, make_slot(i, sc->entries[i].key));
+          if (s && !stash(sc, s)) {
+               deallocate(sc, sc->table, sc->table_size * sizeof sc->table[0]);
+               if (sc->hashes != prev.hashes)
+                    deallocate(sc, sc->hashes, sc->entries_len * sizeof sc->hashes[0]);
+               restore(sc, &prev);
+               return false;
+          }
+     }
+     release(sc, prev.table, prev.table_size * sizeof prev.table[0]);
+     if (sc->hashes != prev.hashes)
+          deallocate(sc, prev.hashes, prev.entries_len * sizeof prev.hashes[0]);
+     return true;
+}
+
+static uint32_t next_seed(uint32_t seed)
+{
+     seed = (seed + 0x9e3779b9) * 0x85ebca6b;
+     return seed ^ (seed>>16);
+}
+
+enum { MAX_RESEEDS = 3 };
+
+static double load_threshold(const small_cuckoo *sc)
+{
+     return threshold_for(sc->ways);
+}
+
+/* A cycle at low load is more likely bad luck with the hash functions
+ * than a full table, so the first few rehashes try fresh seeds at the
+ * same size; near the load threshold that would be wasted work, so we
+ * go straight to growing. */
+static unsigned reseeds_for(const small_cuckoo *sc)
+{
+     return sc->n_entries-1 < 0.8 * load_threshold(sc) * sc->table_size ? MAX_RESEEDS : 0;
+}
+
+static void drop_old_table(small_cuckoo *sc)
+{
+     release(sc, sc->old_table, sc->old_table_size * sizeof sc->old_table[0]);
+     STORE(sc->old_table, NULL);
+     STORE(sc->old_table_size, 0);
+     sc->migrated = 0;
+}
+
+/* A table this many times the size its entries need that still can't
+ * place them never will, if they share their hash pair: copies of one
+ * key, or keys the hash function can't tell apart. */
+enum { MAX_GROWTH = 8 };
+
+static size_t max_table_size(const small_cuckoo *sc)
+{
+     return MAX_GROWTH * table_size_at(sc->n_entries-1, sc->ways, 1.0);
+}
+
+/* Rebuild from entries[], which must include any homeless entry.
+ * Every entry is placed anew, so an incremental resize in progress is
+ * simply abandoned.  Returns false, with the table as it was, rather
+ * than grow past @a limit. */
+static bool rehash(small_cuckoo *sc, size_t limit)
+{
+     size_t table_size = sc->table_size;
+     uint32_t seed = sc->seed;
+     for (unsigned reseeds = reseeds_for(sc); ; ) {
+          if (reseeds) {
+               --reseeds;
+               seed = next_seed(seed);
+          } else {
+               /* More rows alone split most cycles, and keeping the
+                * seed keeps cached hashes valid; only if that fails
+                * is a new seed worth it. */
+               if (table_size > sc->table_size) seed = next_seed(seed);
+               table_size = grown(table_size, sc->ways);
+               if (table_size > limit) return false;
+          }
+          if (rebuild(sc, table_size, seed)) {
+               drop_old_table(sc);
+               return true;
+          }
+     }
+}
+
+static void drop_entry(small_cuckoo *sc, entry_index i);
+
+/* Whether another entry has exactly the hash pair of entry @a i. */
+static bool shares_hash_pair(const small_cuckoo *sc, entry_index i)
+{
+     uint64_t pair = full_hash(sc, sc->seed, sc->entries[i].key);
+     for (entry_index j = 1; j < sc->n_entries; ++j)
+          if (j != i && full_hash(sc, sc->seed, sc->entries[j].key) == pair)
+               return true;
+     return false;
+}
+
+/* What to give up for the homeless entry @a s: itself, or else one
+ * waiting in the stash or the queue, whichever first shares its hash
+ * pair with another entry; NULL if none does. */
+static small_cuckoo_slot *twin_to_give_up(small_cuckoo *sc, small_cuckoo_slot *s)
+{
+     if (shares_hash_pair(sc, slot_entry(*s))) return s;
+     for (unsigned j = 0; j < sc->n_stashed; ++j)
+          if (shares_hash_pair(sc, slot_entry(sc->stash[j]))) return &sc->stash[j];
+     for (unsigned j = 0; j < sc->n_queued; ++j) {
+          small_cuckoo_slot *q = &sc->queue[(sc->queue_head + j) % SMALL_CUCKOO_QUEUE_SIZE];
+          if (shares_hash_pair(sc, slot_entry(*q))) return q;
+     }
+     return NULL;
+}
+
+/* Rehash to make room for the homeless entry @a s, or else give up an
+ * entry; returns whether none was.  Only an entry whose hash pair
+ * another has too is given up, taking @a s's place if it isn't @a s.
+ * Distinct pairs that a table of max_table_size() can't place are the
+ * hash function's fault, so we grow on, and abort rather than lose a
+ * key if even that fails. */
+static bool rehash_or_give_up(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     if (rehash(sc, max_table_size(sc))) return true;
+     small_cuckoo_slot *p = twin_to_give_up(sc, &s);
+     if (!p) {
+          ENSURE(rehash(sc, MAX_GROWTH * max_table_size(sc)));
+          return true;
+     }
+     entry_index i = slot_entry(*p);
+     STORE(*p, s);
+     drop_entry(sc, i);
+     return false;
+}
+
+/* With SMALL_CUCKOO_INCREMENTAL, a full table is set aside rather
+ * than rebuilt: lookups probe it as well as the new one, and each
+ * insert moves the next MIGRATE_SLOTS of its slots across.  The new
+ * table has room for half as many entries again, so even at two-way
+ * loads the old one is drained after a quarter of the inserts that
+ * would fill it; if it fills anyway, we fall back to rehash() rather
+ * than keep a third table. */
+enum { MIGRATE_SLOTS = 8 };
+
+static bool insert(small_cuckoo *sc, small_cuckoo_slot s);
+
+static bool start_migration(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     bool reseed = reseeds_for(sc);
+     if (sc->old_table || (!reseed && grown(sc->table_size, sc->ways) > max_table_size(sc)))
+          return rehash_or_give_up(sc, s);
+     STORE(sc->old_table, sc->table);
+     STORE(sc->old_table_size, sc->table_size);
+     STORE(sc->old_seed, sc->seed);
+     sc->migrated = 0;
+     if (reseed) {
+          /* Cached hashes are brought up to the new seed as their
+           * entries reach the new table, not all at once here: @a s,
+           * the stash and the queue now, the rest in migrate(). */
+          STORE(sc->seed, next_seed(sc->seed));
+          rehash_entry(sc, slot_entry(s));
+          for (unsigned j = 0; j < sc->n_stashed; ++j)
+               rehash_entry(sc, slot_entry(sc->stash[j]));
+          for (unsigned j = 0; j < sc->n_queued; ++j)
+               rehash_entry(sc, slot_entry(sc->queue[(sc->queue_head + j) % SMALL_CUCKOO_QUEUE_SIZE]));
+     } else
+          STORE(sc->table_size, grown(sc->table_size, sc->ways));
+     sc->walk_len = 0;          /* The queue's head now starts afresh. */
+     small_cuckoo_slot *table;
+     ENSURE(table = allocate_zeroed(sc, sc->table_size * sizeof table[0]));
+     PUBLISH(sc->table, table);
+     /* Move what we can of the stash to the new table, or it would
+      * stay full.  The rest stays put, so no entry is ever homeless but
+      * @a s. */
+     for (unsigned j = sc->n_stashed; j-- > 0; )
+          if (!place(sc, sc->stash[j])) {
+               STORE(sc->n_stashed, sc->n_stashed - 1);
+               STORE(sc->stash[j], sc->stash[sc->n_stashed]);
+          }
+     return insert(sc, s);
+}
+
+static bool migrate(small_cuckoo *sc)
+{
+     bool kept = true;
+     size_t end = sc->migrated + MIGRATE_SLOTS;
+     if (end > sc->old_table_size) end = sc->old_table_size;
+     while (sc->migrated < end) {
+          small_cuckoo_slot s = sc->old_table[sc->migrated];
+          STORE(sc->old_table[sc->migrated++], 0);
+          if (!s) continue;
+          if (sc->old_seed != sc->seed) rehash_entry(sc, slot_entry(s));
+          kept &= insert(sc, s);
+          if (!sc->old_table) return kept;     /* rehash() took over. */
+     }
+     if (sc->migrated == sc->old_table_size)
+          drop_old_table(sc);
+     return kept;
+}
+
+/* Make room for the homeless entry @a s, giving it up if the table
+ * would grow too far; returns whether it was kept. */
+static bool grow(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     if (sc->flags & SMALL_CUCKOO_INCREMENTAL) return start_migration(sc, s);
+     return rehash_or_give_up(sc, s);
+}
+
+static bool insert_at(small_cuckoo *sc, small_cuckoo_slot s, size_t h[MAX_WAYS])
+{
+     s = place_at(sc, s, h);
+     /* One unlucky cycle shouldn't cost us a rehash of everything. */
+     return !s || stash(sc, s) || grow(sc, s);
+}
+
+static bool insert(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     size_t h[MAX_WAYS];
+     entry_slots(sc, slot_entry(s), h);
+     return insert_at(sc, s, h);
+}
+
+/* With SMALL_CUCKOO_REALTIME, new entries join a queue and each
+ * insert moves the one at its head along a plain cuckoo walk for
+ * REALTIME_STEPS displacements.  The head kicks out the occupant of
+ * its first slot if none is free, and each entry kicked out tries the
+ * choice after the one it was evicted from.  A walk longer than
+ * MAX_WALK, or a full queue, hands an entry to the breadth-first
+ * search instead, bounded but up to MAX_BFS_NODES slots of work.
+ * Walks lengthen sharply near the load threshold, so these tables
+ * grow at 90% of it.
+ *
+ * The bound is on slot writes, not time.  These still stall:
+ *  - the search failing with the stash full, which grows the table:
+ *    allocating it, or all of rehash() without
+ *    SMALL_CUCKOO_INCREMENTAL or if a resize is already under way;
+ *  - doubling entries[], which copies it;
+ *  - small_cuckoo_reserve and small_cuckoo_shrink_to_fit, which
+ *    rebuild. */
+enum { REALTIME_STEPS = 4, MAX_WALK = 32 };
+
+static small_cuckoo_slot dequeue(small_cuckoo *sc)
+{
+     small_cuckoo_slot s = sc->queue[sc->queue_head];
+     STORE(sc->queue_head, (sc->queue_head + 1) % SMALL_CUCKOO_QUEUE_SIZE);
+     STORE(sc->n_queued, sc->n_queued - 1);
+     sc->walk_len = 0;
+     return s;
+}
+
+static bool enqueue(small_cuckoo *sc, small_cuckoo_slot s)
+{
+     small_cuckoo_slot t = 0;
+     if (sc->n_queued == SMALL_CUCKOO_QUEUE_SIZE)
+          t = dequeue(sc);
+     STORE(sc->queue[(sc->queue_head + sc->n_queued) % SMALL_CUCKOO_QUEUE_SIZE], s);
+     STORE(sc->n_queued, sc->n_queued + 1);
+     /* Only now, so that only @a t is homeless if it has to go. */
+     return !t || insert(sc, t);
+}
+
+static bool walk(small_cuckoo *sc)
+{
+     bool kept = true;
+     for (unsigned n = 0; n < REALTIME_STEPS && sc->n_queued; ++n) {
+          small_cuckoo_slot s = sc->queue[sc->queue_head];
+          size_t h[MAX_WAYS];
+          entry_slots(sc, slot_entry(s), h);
+          unsigned c = 0;
+          if (sc->walk_len) c = (sc->walk_choice + 1) % sc->ways;
+          else {
+               while (c < sc->ways && sc->table[h[c]]) ++c;
+               if (c == sc->ways) c = 0;
+          }
+          size_t p = h[c];
+          small_cuckoo_slot t = sc->table[p];
+          STORE(sc->table[p], s);
+          if (!t) {
+               count_path(sc->walk_len + 1);
+               dequeue(sc);
+          } else if (++sc->walk_len == MAX_WALK) {
+               dequeue(sc);
+               kept &= insert(sc, t);
+          } else {
+               STORE(sc->queue[sc->queue_head], t);
+               sc->walk_choice = p % sc->ways;
+          }
+     }
+     return kept;
+}
+
+/* Resize entries[] (and the cached hashes) to @a len entries.  This
+ * copies them all, the one O(n) step left in an incremental insert. */
+static void resize_entries(small_cuckoo *sc, size_t len)
+{
+     ENSURE(len <= MAX_ENTRIES);
+     size_t old_len = sc->entries_len;
+     STORE(sc->entries_len, len);
+     if (sc->flags & SMALL_CUCKOO_CONCURRENT) {
+          /* Readers may be looking at the old array: copy, don't move. */
+          void *prev = sc->entries, *entries;
+          ENSURE(entries = allocate(sc, len * sizeof sc->entries[0]));
+          memcpy(entries, prev, (old_len < len ? old_len : len) * sizeof sc->entries[0]);
+          PUBLISH(sc->entries, entries);
+          release(sc, prev, old_len * sizeof sc->entries[0]);
+     } else
+          ENSURE(sc->entries = reallocate(sc, sc->entries, old_len * sizeof sc->entries[0],
+                                          len * sizeof sc->entries[0]));
+     if (sc->hashes)
+          ENSURE(sc->hashes = reallocate(sc, sc->hashes, old_len * sizeof sc->hashes[0],
+                                         len * sizeof sc->hashes[0]));
+}
+
+/* Add a new entry for @a key, whose hash pair is @a pair and whose
+ * slots are @a h, and return its index, or 0 if an entry had to be
+ * given up on the way, which may have been this one or moved it. */
+static entry_index add(small_cuckoo *sc, uint64_t key, uint64_t value, uint64_t pair, size_t h[MAX_WAYS])
+{
+     entry_index i = sc->n_entries;
+     ENSURE(i > 0 && i < MAX_ENTRIES);
+     ++sc->n_entries;
+     if (sc->n_entries > sc->entries_len)
+          resize_entries(sc, sc->entries_len < MAX_ENTRIES/2 ? 2*sc->entries_len : MAX_ENTRIES);
+     STORE(sc->entries[i].key, key);
+     STORE(sc->entries[i].value, value);
+     if (sc->hashes) sc->hashes[i] = pair;
+     bool kept;
+     if (sc->flags & SMALL_CUCKOO_REALTIME) {
+          if (!sc->old_table && sc->n_entries-1 > 0.9 * load_threshold(sc) * sc->table_size)
+               kept = grow(sc, make_slot(i, key));
+          else
+               kept = enqueue(sc, make_slot(i, key));
+          kept &= walk(sc);
+     } else
+          kept = insert_at(sc, make_slot(i, key), h);
+     return kept ? i : 0;
+}
+
+bool small_cuckoo_insert(small_cuckoo *sc, uint64_t key, uint64_t value)
+{
+     write_begin(sc);
+     bool kept = !sc->old_table || migrate(sc);
+     uint64_t pair = full_hash(sc, sc->seed, key);
+     size_t h[MAX_WAYS];
+     slots_of_pair(sc->table_size, sc->ways, pair, pair>>32, h);
+     kept &= add(sc, key, value, pair, h) != 0;
+     write_end(sc);
+     return kept;
+}
+
+/* Offline construction: the table is sized once and entries[] laid
+ * out once, in hash_1 order by a counting sort, so entries sharing
+ * table lines share entry lines too.  Then every key whose hash_1
+ * slot is uncontested takes it, the rest try their hash_2 slot, and
+ * only what is left goes through the usual eviction walk. */
+small_cuckoo small_cuckoo_build_opts(const uint64_t *keys, const uint64_t *values, size_t n,
+                                     const small_cuckoo_opts *opts)
+{
+     ENSURE(n < MAX_ENTRIES);
+     small_cuckoo sc = {0};
+     apply_opts(&sc, opts);
+     sc.table_size = table_size_at(n, sc.ways, 0.9);
+     ENSURE(sc.table = allocate_zeroed(&sc, sc.table_size * sizeof sc.table[0]));
+     sc.n_entries = sc.entries_len = 1+n;
+     ENSURE(sc.entries = allocate(&sc, sc.entries_len * sizeof sc.entries[0]));
+     sc.entries[0].key = sc.entries[0].value = 0;
+
+     size_t rows = n_rows(sc.table_size, sc.ways), h[MAX_WAYS];
+     uint32_t *start, *r1;
+     ENSURE(start = allocate_zeroed(&sc, (rows+1) * sizeof *start));
+     ENSURE(r1 = allocate(&sc, (n ? n : 1) * sizeof *r1));
+     for (size_t j = 0; j < n; ++j) {
+          slots(&sc, keys[j], h);
+          r1[j] = h[0] / sc.ways;
+          ++start[r1[j] + 1];
+     }
+     for (size_t r = 0; r < rows; ++r)
+          start[r+1] += start[r];
+     for (size_t j = 0; j < n; ++j) {
+          entry_index i = 1 + start[r1[j]]++;
+          sc.entries[i].key = keys[j];
+          sc.entries[i].value = values ? values[j] : 0;
+     }
+     deallocate(&sc, r1, (n ? n : 1) * sizeof *r1);
+     deallocate(&sc, start, (rows+1) * sizeof *start);
+     if (sc.flags & SMALL_CUCKOO_CACHE_HASHES) {
+          ENSURE(sc.hashes = allocate(&sc, sc.entries_len * sizeof sc.hashes[0]));
+          hash_entries(&sc);
+     }
+
+     /* Collisions are queued in place at the front of a scratch list,
+      * for each choice in turn and then for the general path. */
+     entry_index *later, n_left = n;
+     ENSURE(later = allocate(&sc, (n ? n : 1) * sizeof *later));
+     for (entry_index j = 0; j < n; ++j)
+          later[j] = j+1;
+     for (unsigned c = 0; c < sc.ways; ++c) {
+          entry_index n_later = n_left;
+          n_left = 0;
+          for (entry_index j = 0; j < n_later; ++j) {
+               entry_index i = later[j];
+               slots(&sc, sc.entries[i].key, h);
+               if (sc.table[h[c]]) later[n_left++] = i;
+               else sc.table[h[c]] = make_slot(i, sc.entries[i].key);
+          }
+     }
+     for (entry_index j = 0; j < n_left; ++j) {
+          entry_index i = later[j];
+          small_cuckoo_slot s = place(&sc, make_slot(i, sc.entries[i].key));
+          if (s && !stash(&sc, s)) {
+               /* This re-places every entry, including the rest. */
+               ENSURE(rehash(&sc, max_table_size(&sc)));
+               break;
+          }
+     }
+     deallocate(&sc, later, (n ? n : 1) * sizeof *later);
+     return sc;
+}
+
+small_cuckoo small_cuckoo_build(const uint64_t *keys, const uint64_t *values, size_t n)
+{
+     return small_cuckoo_build_opts(keys, values, n, NULL);
+}
+
+/* Entry index of @a key if it was stashed, else 0. */
+static inline entry_index find_in_stash(small_cuckoo *sc, uint64_t key)
+{
+     for (unsigned j = 0; j < sc->n_stashed; ++j) {
+          entry_index i = slot_entry(sc->stash[j]);
+          if (sc->entries[i].key == key) return i;
+     }
+     return 0;
+}
+
+/* Entry index of @a key in @a table given its slots @a h, else 0. */
+static inline entry_index find_in_table(small_cuckoo *sc, const small_cuckoo_slot *table,
+                                     uint64_t key, const size_t h[MAX_WAYS])
+{
+     uint16_t tag = fingerprint(key);
+     for (int j = 0; j < sc->ways; ++j) {
+          small_cuckoo_slot s = table[h[j]];
+          if (s && slot_may_hold(s, tag) && sc->entries[slot_entry(s)].key == key)
+               return slot_entry(s);
+     }
+     return 0;
+}
+
+/* Entry index of @a key if it is waiting to be placed, else 0. */
+static inline entry_index find_in_queue(small_cuckoo *sc, uint64_t key)
+{
+     for (unsigned j = 0; j < sc->n_queued; ++j) {
+          entry_index i = slot_entry(sc->queue[(sc->queue_head + j) % SMALL_CUCKOO_QUEUE_SIZE]);
+          if (sc->entries[i].key == key) return i;
+     }
+     return 0;
+}
+
+/* Whether keys can be anywhere but the current table. */
+static inline bool has_elsewhere(const small_cuckoo *sc)
+{
+     return sc->n_stashed || sc->n_queued || sc->old_table;
+}
+
+/* Entry index of @a key if it is anywhere but the current table, else 0. */
+static entry_index find_elsewhere(small_cuckoo *sc, uint64_t key)
+{
+     entry_index i = find_in_stash(sc, key);
+     if (!i) i = find_in_queue(sc, key);
+     if (i || !sc->old_table) return i;
+     size_t h[MAX_WAYS];
+     slots_in(sc, sc->old_table_size, sc->old_seed, key, h);
+     return find_in_table(sc, sc->old_table, key, h);
+}
+
+/* Entry index of @a key given its slots @a h, else 0. */
+static inline entry_index find_entry(small_cuckoo *sc, uint64_t key, const size_t h[MAX_WAYS])
+{
+     entry_index i = find_in_table(sc, sc->table, key, h);
+     if (i || !has_elsewhere(sc)) return i;
+     return find_elsewhere(sc, key);
+}
+
+/* Load what a lookup needs of @a sc into @a snap, which gets nothing
+ * else.  Arrays are loaded with acquire, to see what the writer put
+ * in them before publishing them; the stash and queue are read in
+ * place, and only up to the counts loaded here. */
+static inline void take_snapshot(const small_cuckoo *sc, small_cuckoo *snap)
+{
+     snap->hash = sc->hash;     /* These two never change. */
+     snap->ways = sc->ways;
+     snap->table = __atomic_load_n(&sc->table, __ATOMIC_ACQUIRE);
+     snap->table_size = LOAD(sc->table_size);
+     snap->seed = LOAD(sc->seed);
+     snap->entries = __atomic_load_n(&sc->entries, __ATOMIC_ACQUIRE);
+     snap->entries_len = LOAD(sc->entries_len);
+     snap->n_stashed = LOAD(sc->n_stashed);
+     snap->queue_head = LOAD(sc->queue_head);
+     snap->n_queued = LOAD(sc->n_queued);
+     snap->old_table = __atomic_load_n(&sc->old_table, __ATOMIC_ACQUIRE);
+     snap->old_table_size = LOAD(sc->old_table_size);
+     snap->old_seed = LOAD(sc->old_seed);
+}
+
+/* Whether slot @a s, loaded from an array of @a snap or shared with
+ * it, names @a key.  The writer may have replaced entries[] since the
+ * snapshot and put an index beyond the snapshot's in a table they
+ * share, so the index is checked before it is followed. */
+static inline bool snapshot_holds(const small_cuckoo *snap, small_cuckoo_slot s, uint64_t key)
+{
+     entry_index i = slot_entry(s);
+     return i && i < snap->entries_len && LOAD(snap->entries[i].key) == key;
+}
+
+/* Entry index of @a key in @a snap of @a sc, else 0.  Slots are
+ * loaded one at a time, so each is checked and followed as the same
+ * value, and the stash and queue positions are kept in bounds. */
+static entry_index find_in_snapshot(const small_cuckoo *sc, const small_cuckoo *snap, uint64_t key)
+{
+     size_t h[MAX_WAYS];
+     small_cuckoo_slot s;
+     slots(snap, key, h);
+     for (unsigned j = 0; j < snap->ways; ++j)
+          if (snapshot_holds(snap, s = LOAD(snap->table[h[j]]), key))
+               return slot_entry(s);
+     for (unsigned j = 0; j < snap->n_stashed && j < SMALL_CUCKOO_STASH_SIZE; ++j)
+          if (snapshot_holds(snap, s = LOAD(sc->stash[j]), key))
+               return slot_entry(s);
+     for (unsigned j = 0; j < snap->n_queued && j < SMALL_CUCKOO_QUEUE_SIZE; ++j) {
+          s = LOAD(sc->queue[(snap->queue_head + j) % SMALL_CUCKOO_QUEUE_SIZE]);
+          if (snapshot_holds(snap, s, key)) return slot_entry(s);
+     }
+     if (!snap->old_table) return 0;
+     slots_in(snap, snap->old_table_size, snap->old_seed, key, h);
+     for (unsigned j = 0; j < snap->ways; ++j)
+          if (snapshot_holds(snap, s = LOAD(snap->old_table[h[j]]), key))
+               return slot_entry(s);
+     return 0;
+}
+
+/* The readers' side of the seqlock.  The fields a lookup needs are
+ * loaded while the writer is idle, so its arrays and their sizes
+ * agree and none of them can be freed under us; the lookup counts
+ * only if the writer stayed idle throughout. */
+static bool find_concurrent(small_cuckoo *sc, uint64_t key, uint64_t *value)
+{
+     for (;;) {
+          uint32_t version = __atomic_load_n(&sc->version, __ATOMIC_ACQUIRE);
+          if (version & 1) continue;
+          small_cuckoo snap;
+          take_snapshot(sc, &snap);
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+          if (__atomic_load_n(&sc->version, __ATOMIC_RELAXED) != version) continue;
+          entry_index i = find_in_snapshot(sc, &snap, key);
+          uint64_t v = i ? LOAD(snap.entries[i].value) : 0;
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+          if (__atomic_load_n(&sc->version, __ATOMIC_RELAXED) != version) continue;
+          if (i && value) *value = v;
+          return i != 0;
+     }
+}
+
+bool small_cuckoo_find(small_cuckoo *sc, uint64_t key, uint64_t *value)
+{
+     if (sc->flags & SMALL_CUCKOO_CONCURRENT) return find_concurrent(sc, key, value);
+     size_t h[MAX_WAYS];
+     slots(sc, key, h);
+     entry_index i = find_entry(sc, key, h);
+     if (i && value) *value = sc->entries[i].value;
+     return i != 0;
+}
+
+bool small_cuckoo_find_hashed(small_cuckoo *sc, uint64_t key, uint64_t hash, uint64_t *value)
+{
+     /* @a hash may be under a seed the writer has since replaced. */
+     if (sc->flags & SMALL_CUCKOO_CONCURRENT) return find_concurrent(sc, key, value);
+     size_t h[MAX_WAYS];
+     slots_of_pair(sc->table_size, sc->ways, hash, hash>>32, h);
+     entry_index i = find_entry(sc, key, h);
+     if (i && value) *value = sc->entries[i].value;
+     return i != 0;
+}
+
+/* Entry index of @a key, adding it with @a value if it is missing. */
+static entry_index find_or_add(small_cuckoo *sc, uint64_t key, uint64_t value)
+{
+     /* Migrate first, so the slots stay good for the insert. */
+     if (sc->old_table) migrate(sc);
+     uint64_t pair = full_hash(sc, sc->seed, key);
+     size_t h[MAX_WAYS];
+     slots_of_pair(sc->table_size, sc->ways, pair, pair>>32, h);
+     entry_index i = find_entry(sc, key, h);
+     if (i || (i = add(sc, key, value, pair, h))) return i;
+     /* Something was given up: perhaps this, perhaps an entry whose
+      * place it took. */
+     slots(sc, key, h);
+     return find_entry(sc, key, h);
+}
+
+uint64_t *small_cuckoo_find_or_insert(small_cuckoo *sc, uint64_t key, uint64_t value)
+{
+     /* Not in one expression: adding may move entries[]. */
+     write_begin(sc);
+     entry_index i = find_or_add(sc, key, value);
+     write_end(sc);
+     return i ? &sc->entries[i].value : NULL;
+}
+
+uint64_t *small_cuckoo_upsert(small_cuckoo *sc, uint64_t key, uint64_t value)
+{
+     write_begin(sc);
+     entry_index i = find_or_add(sc, key, value);
+     if (i) STORE(sc->entries[i].value, value);
+     write_end(sc);
+     return i ? &sc->entries[i].value : NULL;
+}
+
+static void reserve(small_cuckoo *sc, size_t n)
+{
+     if (1+n > sc->entries_len) resize_entries(sc, 1+n);
+     size_t table_size = table_size_at(n, sc->ways, 0.9);
+     if (table_size <= sc->table_size) return;
+     /* Never settle for less than was asked for: if the seed we have
+      * fails at this size, try others, and only then grow further. */
+     uint32_t seed = sc->seed;
+     for (unsigned tries = 0; !rebuild(sc, table_size, seed); ++tries) {
+          seed = next_seed(seed);
+          if (tries >= MAX_RESEEDS) table_size = grown(table_size, sc->ways);
+     }
+     drop_old_table(sc);
+}
+
+void small_cuckoo_reserve(small_cuckoo *sc, size_t n)
+{
+     write_begin(sc);
+     reserve(sc, n);
+     write_end(sc);
+}
+
+/* Try the smallest table that could possibly hold everything, then
+ * grow until the entries fit; at worst we end up where we began. */
+static void shrink_to_fit(small_cuckoo *sc)
+{
+     resize_entries(sc, sc->n_entries);
+     size_t table_size = table_size_at(sc->n_entries-1, sc->ways, 1.0);
+     if (table_size >= sc->table_size && !sc->old_table) return;
+     for (; table_size < sc->table_size; table_size = grown(table_size, sc->ways))
+          if (rebuild(sc, table_size, sc->seed)) {
+               drop_old_table(sc);
+               return;
+          }
+     if (rebuild(sc, sc->table_size, sc->seed)) drop_old_table(sc);
+     else rehash(sc, max_table_size(sc));
+}
+
+void small_cuckoo_shrink_to_fit(small_cuckoo *sc)
+{
+     write_begin(sc);
+     shrink_to_fit(sc);
+     write_end(sc);
+}
+
+/* The slot naming entry @a i, whose key is @a key, wherever it is. */
+static small_cuckoo_slot *locate(small_cuckoo *sc, uint64_t key, entry_index i)
+{
+     size_t h[MAX_WAYS];
+     slots(sc, key, h);
+     for (unsigned c = 0; c < sc->ways; ++c)
+          if (slot_entry(sc->table[h[c]]) == i) return &sc->table[h[c]];
+     for (unsigned j = 0; j < sc->n_stashed; ++j)
+          if (slot_entry(sc->stash[j]) == i) return &sc->stash[j];
+     for (unsigned j = 0; j < sc->n_queued; ++j) {
+          small_cuckoo_slot *q = &sc->queue[(sc->queue_head + j) % SMALL_CUCKOO_QUEUE_SIZE];
+          if (slot_entry(*q) == i) return q;
+     }
+     ENSURE(sc->old_table);
+     slots_in(sc, sc->old_table_size, sc->old_seed, key, h);
+     for (unsigned c = 0; c < sc->ways; ++c)
+          if (slot_entry(sc->old_table[h[c]]) == i) return &sc->old_table[h[c]];
+     ENSURE(!"entry not in the table");
+     return NULL;
+}
+
+/* Empty @a p, as found by locate(). */
+static void unlink_slot(small_cuckoo *sc, small_cuckoo_slot *p)
+{
+     if (p >= sc->stash && p < sc->stash + sc->n_stashed) {
+          STORE(sc->n_stashed, sc->n_stashed - 1);
+          STORE(*p, sc->stash[sc->n_stashed]);
+          return;
+     }
+     if (p < sc->queue || p >= sc->queue + SMALL_CUCKOO_QUEUE_SIZE) {
+          STORE(*p, 0);
+          return;
+     }
+     unsigned k = (p - sc->queue + SMALL_CUCKOO_QUEUE_SIZE - sc->queue_head) % SMALL_CUCKOO_QUEUE_SIZE;
+     if (k == 0) {
+          dequeue(sc);
+          return;
+     }
+     for (; k+1 < sc->n_queued; ++k)
+          STORE(sc->queue[(sc->queue_head + k) % SMALL_CUCKOO_QUEUE_SIZE],
+                sc->queue[(sc->queue_head + k+1) % SMALL_CUCKOO_QUEUE_SIZE]);
+     STORE(sc->n_queued, sc->n_queued - 1);
+}
+
+/* Halve the table once its load falls to a quarter of the threshold,
+ * so a table that grew and then emptied gives the memory back; the
+ * gap to the growth threshold keeps it from flapping.  The seed stays,
+ * as do any cached hashes. */
+static void maybe_shrink(small_cuckoo *sc)
+{
+     if (sc->old_table || sc->table_size <= sc->ways) return;
+     if (sc->n_entries-1 >= load_threshold(sc) / 4 * sc->table_size) return;
+     rebuild(sc, sc->table_size / sc->ways / 2 * sc->ways, sc->seed);
+}
+
+/* Remove entry @a i, which no slot names any more, keeping entries[]
+ * dense by moving the last entry into the hole. */
+static void drop_entry(small_cuckoo *sc, entry_index i)
+{
+     entry_index last = --sc->n_entries;
+     if (i == last) return;
+     uint64_t k = sc->entries[last].key;
+     STORE(*locate(sc, k, last), make_slot(i, k));
+     STORE(sc->entries[i].key, k);
+     STORE(sc->entries[i].value, sc->entries[last].value);
+     if (sc->hashes) sc->hashes[i] = sc->hashes[last];
+}
+
+static bool erase(small_cuckoo *sc, uint64_t key)
+{
+     size_t h[MAX_WAYS];
+     slots(sc, key, h);
+     entry_index i = find_entry(sc, key, h);
+     if (!i) return false;
+     unlink_slot(sc, locate(sc, key, i));
+     drop_entry(sc, i);
+     /* Keep draining, or a table that only empties would never shrink. */
+     if (sc->old_table) migrate(sc);
+     maybe_shrink(sc);
+     return true;
+}
+
+bool small_cuckoo_erase(small_cuckoo *sc, uint64_t key)
+{
+     write_begin(sc);
+     bool erased = erase(sc, key);
+     write_end(sc);
+     return erased;
+}
+
+/* Vectorized probe kernels for AVX2 (8 keys) and AVX-512 (16 keys).
+ * Larson's hash is computed in all lanes at once; hash_2 has no
+ * vector form when it is CRC32, so its lanes are filled in with the
+ * scalar instruction, which pipelines at one per cycle anyway.  Both
+ * slots of a key live in the same aligned pair of the table (hash_1
+ * even, hash_2 odd), so we gather 32-bit pairs and pick the half we
+ * want.  Each kernel returns a mask of the lanes whose key was found,
+ * having filled in their values. */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(SMALL_CUCKOO_FINGERPRINT) && \
+    !defined(SMALL_CUCKOO_WIDE)
+#define HAVE_SIMD_PROBE 1
+
+#include <immintrin.h>
+
+/* hash_2 alone, the kernels having done hash_1.  Generic builds'
+ * larson_crc32_hash would compute Larson's hash again, so its CRC32
+ * half is inlined instead; any CPU with AVX2 has the instruction. */
+__attribute__((target("sse4.2")))
+static inline uint32_t kernel_hash_2(const small_cuckoo *sc, uint64_t key)
+{
+#ifdef HAVE_CRC32_DISPATCH
+     if (sc->hash) return _mm_crc32_u64(-1, seeded(key, sc->seed));
+#endif
+     return raw_hash_2(sc->seed, key);
+}
+
+__attribute__((target("avx2")))
+static uint32_t probe_avx2(small_cuckoo *sc, const uint64_t *keys, uint64_t *values)
+{
+     const __m256i k0 = _mm256_loadu_si256((const __m256i *)keys);
+     const __m256i k1 = _mm256_loadu_si256((const __m256i *)(keys+4));
+     __m256i s0 = k0, s1 = k1;
+     if (sc->seed) {
+          uint64_t hashed[8];
+          for (int j = 0; j < 8; ++j)
+               hashed[j] = seeded(keys[j], sc->seed);
+          s0 = _mm256_loadu_si256((const __m256i *)hashed);
+          s1 = _mm256_loadu_si256((const __m256i *)(hashed+4));
+     }
+     const __m256i evens_odds = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+     __m256i a = _mm256_permutevar8x32_epi32(s0, evens_odds);
+     __m256i b = _mm256_permutevar8x32_epi32(s1, evens_odds);
+     __m256i lo = _mm256_permute2x128_si256(a, b, 0x20);
+     __m256i hi = _mm256_permute2x128_si256(a, b, 0x31);
+
+     const __m256i M = _mm256_set1_epi32(101), bytes = _mm256_set1_epi32(0xff);
+     __m256i h = _mm256_set1_epi32(0xdeadbeef);
+#define STEP(v,shift) h = _mm256_add_epi32(_mm256_mullo_epi32(h, M), \
+                                           _mm256_and_si256(_mm256_srli_epi32(v, shift), bytes))
+     STEP(lo,0); STEP(lo,8); STEP(lo,16); STEP(lo,24);
+     STEP(hi,0); STEP(hi,8); STEP(hi,16); STEP(hi,24);
+#undef STEP
+     h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x9e3779b1));
+     /* fastrange() in even and odd lanes separately. */
+     const __m256i rows = _mm256_set1_epi32(sc->table_size>>1);
+     __m256i r1 = _mm256_blend_epi32(_mm256_srli_epi64(_mm256_mul_epu32(h, rows), 32),
+                                     _mm256_mul_epu32(_mm256_srli_epi64(h, 32), rows), 0xaa);
+
+     uint32_t r2_lanes[8];
+     for (int j = 0; j < 8; ++j)
+          r2_lanes[j] = fastrange(kernel_hash_2(sc, keys[j]), sc->table_size>>1);
+     __m256i r2 = _mm256_loadu_si256((const __m256i *)r2_lanes);
+
+     const __m256i slot_mask = _mm256_set1_epi32(0xffff);
+     __m256i e1 = _mm256_and_si256(_mm256_i32gather_epi32((const int *)sc->table, r1, 4), slot_mask);
+     __m256i e2 = _mm256_srli_epi32(_mm256_i32gather_epi32((const int *)sc->table, r2, 4), 16);
+
+     /* Entries are 16 bytes, beyond the largest gather scale. */
+     __m256i x1 = _mm256_slli_epi32(e1, 1), x2 = _mm256_slli_epi32(e2, 1);
+     const long long *ek = (const long long *)sc->entries;
+#define MATCH(x,half,k) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64( \
+                    _mm256_i32gather_epi64(ek, _mm256_extracti128_si256(x, half), 8), k)))
+     uint32_t m1 = MATCH(x1,0,k0) | MATCH(x1,1,k1)<<4;
+     uint32_t m2 = MATCH(x2,0,k0) | MATCH(x2,1,k1)<<4;
+#undef MATCH
+     const __m256i zero = _mm256_setzero_si256();
+     m1 &= ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(e1, zero)));
+     m2 &= ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(e2, zero)));
+
+     uint32_t found = m1 | m2;
+     if (values) {
+          uint32_t i1[8], i2[8];
+          _mm256_storeu_si256((__m256i *)i1, e1);
+          _mm256_storeu_si256((__m256i *)i2, e2);
+          for (uint32_t m = found; m; ) {
+               uint32_t j = bitmap_next(&m);
+               values[j] = sc->entries[(m1 & (1u<<j)) ? i1[j] : i2[j]].value;
+          }
+     }
+     return found;
+}
+
+__attribute__((target("avx512f")))
+static uint32_t probe_avx512(small_cuckoo *sc, const uint64_t *keys, uint64_t *values)
+{
+     const __m512i k0 = _mm512_loadu_si512(keys);
+     const __m512i k1 = _mm512_loadu_si512(keys+8);
+     __m512i s0 = k0, s1 = k1;
+     if (sc->seed) {
+          uint64_t hashed[16];
+          for (int j = 0; j < 16; ++j)
+               hashed[j] = seeded(keys[j], sc->seed);
+          s0 = _mm512_loadu_si512(hashed);
+          s1 = _mm512_loadu_si512(hashed+8);
+     }
+     __m512i lo = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(s0)),
+                                     _mm512_cvtepi64_epi32(s1), 1);
+     __m512i hi = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(_mm512_srli_epi64(s0, 32))),
+                                     _mm512_cvtepi64_epi32(_mm512_srli_epi64(s1, 32)), 1);
+
+     const __m512i M = _mm512_set1_epi32(101), bytes = _mm512_set1_epi32(0xff);
+     __m512i h = _mm512_set1_epi32(0xdeadbeef);
+#define STEP(v,shift) h = _mm512_add_epi32(_mm512_mullo_epi32(h, M), \
+                                           _mm512_and_si512(_mm512_srli_epi32(v, shift), bytes))
+     STEP(lo,0); STEP(lo,8); STEP(lo,16); STEP(lo,24);
+     STEP(hi,0); STEP(hi,8); STEP(hi,16); STEP(hi,24);
+#undef STEP
+     h = _mm512_mullo_epi32(h, _mm512_set1_epi32(0x9e3779b1));
+     const __m512i rows = _mm512_set1_epi32(sc->table_size>>1);
+     __m512i r1 = _mm512_mask_blend_epi32(0xaaaa, _mm512_srli_epi64(_mm512_mul_epu32(h, rows), 32),
+                                          _mm512_mul_epu32(_mm512_srli_epi64(h, 32), rows));
+
+     uint32_t r2_lanes[16];
+     for (int j = 0; j < 16; ++j)
+          r2_lanes[j] = fastrange(kernel_hash_2(sc, keys[j]), sc->table_size>>1);
+     __m512i r2 = _mm512_loadu_si512(r2_lanes);
+
+     __m512i e1 = _mm512_and_si512(_mm512_i32gather_epi32(r1, sc->table, 4), _mm512_set1_epi32(0xffff));
+     __m512i e2 = _mm512_srli_epi32(_mm512_i32gather_epi32(r2, sc->table, 4), 16);
+
+     __m512i x1 = _mm512_slli_epi32(e1, 1), x2 = _mm512_slli_epi32(e2, 1);
+#define MATCH(x,half,k) _mm512_cmpeq_epi64_mask(_mm512_i32gather_epi64( \
+                    _mm512_extracti64x4_epi64(x, half), sc->entries, 8), k)
+     uint32_t m1 = MATCH(x1,0,k0) | MATCH(x1,1,k1)<<8;
+     uint32_t m2 = MATCH(x2,0,k0) | MATCH(x2,1,k1)<<8;
+#undef MATCH
+     m1 &= _mm512_test_epi32_mask(e1, e1);
+     m2 &= _mm512_test_epi32_mask(e2, e2);
+
+     uint32_t found = m1 | m2;
+     if (values) {
+          uint32_t i1[16], i2[16];
+          _mm512_storeu_si512(i1, e1);
+          _mm512_storeu_si512(i2, e2);
+          for (uint32_t m = found; m; ) {
+               uint32_t j = bitmap_next(&m);
+               values[j] = sc->entries[(m1 & (1u<<j)) ? i1[j] : i2[j]].value;
+          }
+     }
+     return found;
+}
+
+/* Number of keys the best kernel this CPU supports probes at once, or
+ * 0 to stay scalar. */
+static int simd_probe_width(void)
+{
+     static int width = -1;
+     int w = __atomic_load_n(&width, __ATOMIC_RELAXED);
+     if (w < 0) {
+          __builtin_cpu_init();
+          w = __builtin_cpu_supports("avx512f") ? 16 : __builtin_cpu_supports("avx2") ? 8 : 0;
+          __atomic_store_n(&width, w, __ATOMIC_RELAXED);
+     }
+     return w;
+}
+
+#endif
+
+/* Lookups are done FIND_BATCH keys at a time, so the batch's cache
+ * misses overlap.  The SIMD kernels hash a batch at once and issue its
+ * gathers together.  In the wide build, other tables go through it in
+ * three passes: hash each key and prefetch its slots, prefetch the
+ * entries those slots name, then compare.  Out-of-order execution
+ * overlaps a plain loop's lookups only as far as its window reaches,
+ * a key or two once each misses twice; at 2M keys the passes take
+ * less than half the time.  Tables of 64k keys mostly stay in cache,
+ * where the passes cost more than they save, so they, and what is
+ * left over, are looked up one key at a time. */
+enum { FIND_BATCH = 16 };
+
+void small_cuckoo_find_batch(small_cuckoo *sc, const uint64_t *keys, size_t n,
+                             uint64_t *values, uint64_t *found_mask)
+{
+     for (size_t w = 0; w < (n+63)/64; ++w)
+          found_mask[w] = 0;
+     if (sc->flags & SMALL_CUCKOO_CONCURRENT) {
+          for (size_t j = 0; j < n; ++j)
+               if (find_concurrent(sc, keys[j], values ? &values[j] : NULL))
+                    found_mask[j/64] |= 1ULL << (j%64);
+          return;
+     }
+
+     size_t base = 0;
+#ifdef HAVE_SIMD_PROBE
+     int width = simd_probe_width();
+     if (width && larson_hash_1(sc) && sc->ways == 2)
+          for (; base + FIND_BATCH <= n; base += FIND_BATCH) {
+               uint32_t found = 0;
+               uint64_t *v = values ? values+base : NULL;
+               for (int j = 0; j < FIND_BATCH; j += width)
+                    found |= (16 == width ? probe_avx512 : probe_avx2)(sc, keys+base+j, v ? v+j : NULL) << j;
+               for (uint32_t m = has_elsewhere(sc) ? ~found & 0xffff : 0; m; ) {
+                    uint32_t j = bitmap_next(&m);
+                    entry_index i = find_elsewhere(sc, keys[base+j]);
+                    if (!i) continue;
+                    if (values) values[base+j] = sc->entries[i].value;
+                    found |= 1u << j;
+               }
+               found_mask[base/64] |= (uint64_t)found << (base%64);
+          }
+#endif
+#ifdef SMALL_CUCKOO_WIDE
+     for (; base + FIND_BATCH <= n; base += FIND_BATCH) {
+          const uint64_t *k = keys+base;
+          size_t h[FIND_BATCH][MAX_WAYS];
+          for (int j = 0; j < FIND_BATCH; ++j) {
+               slots(sc, k[j], h[j]);
+               for (unsigned c = 0; c < sc->ways; ++c)
+                    __builtin_prefetch(&sc->table[h[j][c]]);
+          }
+          for (int j = 0; j < FIND_BATCH; ++j) {
+               uint16_t tag = fingerprint(k[j]);
+               for (unsigned c = 0; c < sc->ways; ++c) {
+                    small_cuckoo_slot s = sc->table[h[j][c]];
+                    if (s && slot_may_hold(s, tag)) __builtin_prefetch(&sc->entries[slot_entry(s)]);
+               }
+          }
+          uint32_t found = 0;
+          for (int j = 0; j < FIND_BATCH; ++j) {
+               entry_index i = find_entry(sc, k[j], h[j]);
+               if (!i) continue;
+               if (values) values[base+j] = sc->entries[i].value;
+               found |= 1u << j;
+          }
+          found_mask[base/64] |= (uint64_t)found << (base%64);
+     }
+#endif
+     for (size_t j = base; j < n; ++j) {
+          size_t h[MAX_WAYS];
+          slots(sc, keys[j], h);
+          entry_index i = find_entry(sc, keys[j], h);
+          if (!i) continue;
+          if (values) values[j] = sc->entries[i].value;
+          found_mask[j/64] |= 1ULL << (j%64);
+     }
+}
+
+void small_cuckoo_free(small_cuckoo *sc)
+{
+     deallocate(sc, sc->table, sc->table_size * sizeof sc->table[0]);
+     deallocate(sc, sc->old_table, sc->old_table_size * sizeof sc->old_table[0]);
+     deallocate(sc, sc->entries, sc->entries_len * sizeof sc->entries[0]);
+     deallocate(sc, sc->hashes, sc->entries_len * sizeof sc->hashes[0]);
+     free_retired(sc, sc->retired);
+     free_retired(sc, sc->retired_before);
+     *sc = (small_cuckoo){0};
+}
+
+/* We only write out the entries, not the table; it gets reconstructed
+ * when we read the metadata.
+ */
+void small_cuckoo_serialize(int fd, small_cuckoo *sc)
+{
+#define WRITE_UNDER(t,x,n) do { uint64_t u = t(x); ENSURE(n == write(fd, &u, n)); } while(0)
+     WRITE_UNDER(htole_index, sc->n_entries, sizeof(entry_index));
+     for (entry_index i = 0; i < sc->n_entries; ++i) {
+          WRITE_UNDER(htole64, sc->entries[i].key, 8);
+          WRITE_UNDER(htole64, sc->entries[i].value, 8);
+     }
+#undef WRITE_UNDER
+}
+
+void small_cuckoo_deserialize(int fd, small_cuckoo *sc)
+{
+     small_cuckoo_deserialize_opts(fd, sc, NULL);
+}
+
+void small_cuckoo_deserialize_opts(int fd, small_cuckoo *sc, const small_cuckoo_opts *opts)
+{
+     *sc = (small_cuckoo){0};
+     apply_opts(sc, opts);
+#define READ(v,n) ENSURE(n == read(fd, v, n))
+#define READ_AND(then,v,n) do { uint64_t u = 0; READ(&u,n); v = then(u); } while(0)
+     READ_AND(le_index_toh, sc->n_entries, sizeof(entry_index));
+     sc->table_size = table_size_at(sc->n_entries-1, sc->ways, 0.9);
+     sc->entries_len = sc->n_entries;
+     ENSURE(sc->entries = allocate(sc, sc->entries_len * sizeof sc->entries[0]));
+     for (entry_index i = 0; i < sc->n_entries; ++i) {
+          READ_AND(le64toh, sc->entries[i].key, 8);
+          READ_AND(le64toh, sc->entries[i].value, 8);
+     }
+#undef READ_AND
+#undef READ
+     if (sc->flags & SMALL_CUCKOO_CACHE_HASHES) {
+          ENSURE(sc->hashes = allocate(sc, sc->entries_len * sizeof sc->hashes[0]));
+          hash_entries(sc);
+     }
+
+     ENSURE(rebuild(sc, sc->table_size, sc->seed) || rehash(sc, max_table_size(sc)));
+}
+
+void small_cuckoo_iterate(small_cuckoo *sc, small_cuckoo_iter *iter)
+{
+     *iter = (small_cuckoo_iter){ .sc = sc, .i = 0 };
+}
+
+/* Positions past the end of the table walk the stash, the queue, then
+ * the old table of an incremental resize. */
+static small_cuckoo_slot iter_slot(small_cuckoo *sc, size_t i)
+{
+     if (i < sc->table_size) return sc->table[i];
+     i -= sc->table_size;
+     if (i < sc->n_stashed) return sc->stash[i];
+     i -= sc->n_stashed;
+     if (i < sc->n_queued) return sc->queue[(sc->queue_head + i) % SMALL_CUCKOO_QUEUE_SIZE];
+     return sc->old_table[i - sc->n_queued];
+}
+
+static size_t iter_end(small_cuckoo *sc)
+{
+     return sc->table_size + sc->n_stashed + sc->n_queued + sc->old_table_size;
+}
+
+bool small_cuckoo_iter_has_next(small_cuckoo_iter *iter)
+{
+     for (; iter->i < iter_end(iter->sc); ++iter->i) {
+          if (iter_slot(iter->sc, iter->i)) return true;
+     }
+     return false;
+}
+
+extern void small_cuckoo_iter_next(small_cuckoo_iter *iter, uint64_t *key, uint64_t *value)
+{
+     ENSURE(small_cuckoo_iter_has_next(iter));
+     entry_index j = slot_entry(iter_slot(iter->sc, iter->i++));
+     if (key) *key = iter->sc->entries[j].key;
+     if (value) *value = iter->sc->entries[j].value;
+}
+
+
+#ifdef UNIT_TEST
+
+#include <tap.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* Fowler-Noll-Vo hash, per http://isthe.com/chongo/tech/comp/fnv/ */
+static uint64_t fnv_hash(uint8_t *data, size_t n)
+{
+     uint64_t h = 14695981039346656037ULL;
+     for (; n > 0; ++data, --n) {
+          h ^= *data;
+          h += (h<<1) + (h<<4) + (h<<5) + (h<<7) + (h<<8) + (h<<40); /* alternately: h *= 1099511628211ULL; */
+     }
+     return h;
+}
+
+/* The idea for this equation comes from section 7.6 of Aho, Sethi,
+ * and Ullmann; Compilers: Principles, Techniques, and Tools (2002).
+ */
+static double evaluate_hash_quality(uint64_t *b, size_t n)
+{
+     double sum = 0.0;
+     for (size_t j = 0; j < n; ++j) {
+          sum += (b[j] * (b[j]+1.0)/2.0);
+     }
+     return sum/(1.5*(double)n-.5);
+}
+
+void test_basic_ops_randomized()
+{
+     int t = time(NULL);
+     note("%s: seed %d", __func__, t);
+     srand(t);
+
+     /* Note: should be a power of two for hash quality tests. */
+     enum { TEST_BASIC_N_ELEMENTS = 1024 };
+     uint64_t keys[TEST_BASIC_N_ELEMENTS] = {0};
+     uint64_t values[TEST_BASIC_N_ELEMENTS] = {0};
+     uint64_t hash_quality_test[2][TEST_BASIC_N_ELEMENTS] = {{0},{0}};
+
+     small_cuckoo sc;
+     sc = small_cuckoo_new(0);
+     for (int i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
+          keys[i] = rand();
+          keys[i] = fnv_hash((uint8_t *)&keys[i], 8);
+          values[i] = rand();
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+          int n = TEST_BASIC_N_ELEMENTS;
+          ++hash_quality_test[0][hash_1(n<<1, 0, keys[i])>>1];
+          ++hash_quality_test[1][hash_2(n<<1, 0, keys[i])>>1];
+     }
+
+     int success = 1;
+     for (int i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, keys[i], &v);
+          success &= v == values[i];
+     }
+     ok(success, "all keys found and values match");
+
+     small_cuckoo_iter iter;
+     small_cuckoo_iterate(&sc, &iter);
+     success = 1;
+     while (small_cuckoo_iter_has_next(&iter) && success) {
+          uint64_t k, v;
+          small_cuckoo_iter_next(&iter, &k, &v);
+          int i;
+          for (i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
+               if (k == keys[i]) {
+                    success &= v == values[i];
+                    keys[i] = 0;
+                    break;
+               }
+          }
+          if (i == TEST_BASIC_N_ELEMENTS) success = 0;
+     }
+     ok(success, "iterator finds all entries inserted");
+
+     small_cuckoo_free(&sc);
+
+     for (int i = 0; i < 2; ++i) {
+          double quality = evaluate_hash_quality(hash_quality_test[i], TEST_BASIC_N_ELEMENTS);
+          note("estimated quality of hash %d is %f\n", i+1, quality);
+          /* Quality below 0.5 would be great but should be
+           * impossible, so we put that test in to catch testing
+           * errors. */
+          ok(quality > 0.5 && quality < 1.05, "hash quality acceptable");
+     }
+}
+
+void test_basic_ops_incremental()
+{
+     note(__func__);
+
+     /* Note: should be a power of two for hash quality tests. */
+     enum { TEST_BASIC_N_ELEMENTS = 1024 };
+     uint64_t hash_quality_test[2][TEST_BASIC_N_ELEMENTS] = {{0},{0}};
+
+     small_cuckoo sc;
+     sc = small_cuckoo_new(0);
+     for (int i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
+          small_cuckoo_insert(&sc, i, i);
+          int n = TEST_BASIC_N_ELEMENTS;
+          ++hash_quality_test[0][hash_1(n<<1, 0, i)>>1];
+          ++hash_quality_test[1][hash_2(n<<1, 0, i)>>1];
+     }
+
+     int success = 1;
+     for (uint32_t i = 0; i < TEST_BASIC_N_ELEMENTS; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, i, &v);
+          success &= v == i;
+     }
+     ok(success, "all keys found and values match");
+
+     small_cuckoo_iter iter;
+     small_cuckoo_iterate(&sc, &iter);
+     success = 1;
+     while (small_cuckoo_iter_has_next(&iter) && success) {
+          uint64_t k, v;
+          small_cuckoo_iter_next(&iter, &k, &v);
+     }
+     ok(success, "iterator finds all entries inserted");
+
+     small_cuckoo_free(&sc);
+
+     for (int i = 0; i < 2; ++i) {
+          double quality = evaluate_hash_quality(hash_quality_test[i], TEST_BASIC_N_ELEMENTS);
+          note("estimated quality of hash %d is %f\n", i+1, quality);
+          /* Quality below 0.5 would be great but should be
+           * impossible, so we put that test in to catch testing
+           * errors. */
+          ok(quality > 0.5 && quality < 1.05, "hash quality acceptable");
+     }
+}
+
+void test_find_batch()
+{
+     note(__func__);
+
+     enum { N = 2048 };
+     static uint64_t keys[N], values[N], mask[N/64];
+     small_cuckoo sc = small_cuckoo_new(0);
+     for (int i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, sizeof i);
+          if (i & 1) small_cuckoo_insert(&sc, keys[i], ~keys[i]);
+     }
+
+     small_cuckoo_find_batch(&sc, keys, N-3, values, mask);
+     int success = 1;
+     for (int i = 0; i < N-3; i++) {
+          uint64_t v;
+          bool found = small_cuckoo_find(&sc, keys[i], &v);
+          success &= found == !!(mask[i/64] & (1ULL << (i%64)));
+          if (found) success &= v == values[i];
+     }
+     success &= !(mask[(N-1)/64] >> ((N-3)%64));
+     ok(success, "batched lookup agrees with small_cuckoo_find");
+
+#ifdef HAVE_SIMD_PROBE
+     success = 1;
+     if (__builtin_cpu_supports("avx2")) {
+          for (int i = 0; i+8 <= N; i += 8) {
+               uint32_t found = probe_avx2(&sc, keys+i, values+i);
+               for (int j = 0; j < 8; ++j) {
+                    /* The kernel only probes the table proper. */
+                    uint64_t v;
+                    bool in_table = small_cuckoo_find(&sc, keys[i+j], &v) && !find_in_stash(&sc, keys[i+j]);
+                    success &= in_table == !!(found & (1u<<j));
+                    if (found & (1u<<j)) success &= v == values[i+j];
+               }
+          }
+     }
+     ok(success, "AVX2 probe kernel agrees with small_cuckoo_find");
+#else
+     ok(1, "# SKIP no SIMD probe kernel");
+#endif
+
+     small_cuckoo_free(&sc);
+}
+
+void test_serialize_roundtrip()
+{
+     note(__func__);
+
+     enum { N = 1000 };
+     small_cuckoo sc = small_cuckoo_new(0), sc2;
+     for (uint64_t i = 0; i < N; i++)
+          small_cuckoo_insert(&sc, fnv_hash((uint8_t *)&i, 8), i);
+
+     FILE *f = tmpfile();
+     small_cuckoo_serialize(fileno(f), &sc);
+     rewind(f);
+     small_cuckoo_deserialize(fileno(f), &sc2);
+     fclose(f);
+
+     int success = sc2.n_entries == sc.n_entries;
+     for (uint64_t i = 0; i < N; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc2, fnv_hash((uint8_t *)&i, 8), &v) && v == i;
+     }
+     small_cuckoo_insert(&sc2, 1ULL<<63, 42);
+     success &= small_cuckoo_find(&sc2, 1ULL<<63, NULL);
+     ok(success, "deserialized table finds every key and accepts inserts");
+
+     small_cuckoo_free(&sc);
+     small_cuckoo_free(&sc2);
+}
+
+void test_stash()
+{
+     note(__func__);
+
+     /* Three copies of one key can never fit its two slots, so the
+      * third has to go to the stash rather than grow the table. */
+     small_cuckoo sc = small_cuckoo_new(64);
+     size_t table_size = sc.table_size;
+     for (uint64_t i = 1; i <= 32; i++)
+          small_cuckoo_insert(&sc, fnv_hash((uint8_t *)&i, 8), i);
+     for (int i = 0; i < 3; i++)
+          small_cuckoo_insert(&sc, 42, 42);
+     ok(sc.n_stashed == 1 && sc.table_size == table_size, "cycle stashed without growing");
+
+     int success = 1;
+     for (uint64_t i = 1; i <= 32; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, fnv_hash((uint8_t *)&i, 8), &v) && v == i;
+     }
+     success &= small_cuckoo_find(&sc, 42, NULL);
+     uint64_t keys[2] = { 42, 43 }, values[2], mask;
+     small_cuckoo_find_batch(&sc, keys, 2, values, &mask);
+     success &= mask == 1 && values[0] == 42;
+     ok(success, "all keys found with a non-empty stash");
+
+     small_cuckoo_iter iter;
+     small_cuckoo_iterate(&sc, &iter);
+     int n = 0, n_42 = 0;
+     while (small_cuckoo_iter_has_next(&iter)) {
+          uint64_t k;
+          small_cuckoo_iter_next(&iter, &k, NULL);
+          ++n;
+          n_42 += k == 42;
+     }
+     ok(n == 35 && n_42 == 3, "iterator visits stashed entries");
+
+     small_cuckoo_free(&sc);
+}
+
+void test_reseed()
+{
+     note(__func__);
+
+     /* Find keys sharing both slots under seed 0; no growth can help
+      * more than 2 of them, but a new seed at the same size can. */
+     enum { N_CLASH = 2+SMALL_CUCKOO_STASH_SIZE+1 };
+     small_cuckoo sc = small_cuckoo_new(32);
+     size_t table_size = sc.table_size;
+     uint64_t clash[16] = {0};
+     int n = 0;
+     for (uint64_t k = 1; n < N_CLASH; ++k) {
+          size_t h[MAX_WAYS];
+          slots(&sc, k, h);
+          if (h[0] == 0 && h[1] == 1) clash[n++] = k;
+     }
+
+     for (int i = 0; i < N_CLASH; i++)
+          small_cuckoo_insert(&sc, clash[i], i);
+     ok(sc.table_size == table_size && sc.seed != 0, "rehashed with a new seed instead of growing");
+
+     int success = 1;
+     for (int i = 0; i < N_CLASH; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, clash[i], &v) && v == (uint64_t)i;
+     }
+     uint64_t values[16], mask;
+     small_cuckoo_find_batch(&sc, clash, 16, values, &mask);
+     success &= mask == (1u<<N_CLASH)-1;
+     for (int i = 0; i < N_CLASH; i++)
+          success &= values[i] == (uint64_t)i;
+     ok(success, "all keys found after reseeding");
+
+     small_cuckoo_free(&sc);
+}
+
+/* A deliberately weak pair, to show the table really uses it. */
+static uint64_t identity_hash(uint64_t key, uint32_t seed)
+{
+     key = seeded(key, seed);
+     return (key & 0xffffffff) | (key>>32 ^ key)<<32;
+}
+
+void test_custom_hash()
+{
+     note(__func__);
+
+     enum { N = 1000 };
+     small_cuckoo sc = small_cuckoo_new_opts(0, &(small_cuckoo_opts){ .hash = identity_hash });
+     for (uint64_t i = 1; i <= N; i++)
+          small_cuckoo_insert(&sc, i, i*i);
+
+     int success = 1;
+     for (uint64_t i = 1; i <= N; i++) {
+          uint64_t v = 0, w = 0;
+          success &= small_cuckoo_find(&sc, i, &v) && v == i*i;
+          success &= small_cuckoo_find_hashed(&sc, i, identity_hash(i, sc.seed), &w) && w == v;
+     }
+     success &= !small_cuckoo_find(&sc, N+1, NULL);
+     ok(success, "table with its own hash pair finds every key");
+     small_cuckoo_free(&sc);
+
+     sc = small_cuckoo_new(0);
+     for (uint64_t i = 1; i <= N; i++)
+          small_cuckoo_insert(&sc, i, i);
+     success = 1;
+     for (uint64_t i = 1; i <= N; i++)
+          success &= small_cuckoo_find_hashed(&sc, i, small_cuckoo_default_hash(i, sc.seed), NULL);
+     ok(success, "small_cuckoo_default_hash matches the built-in hashes");
+     small_cuckoo_free(&sc);
+}
+
+void test_split_hash()
+{
+     note(__func__);
+
+     enum { N = 1024 };
+     uint64_t hash_quality_test[2][N] = {{0},{0}};
+     small_cuckoo sc = small_cuckoo_new_opts(0, &(small_cuckoo_opts){ .hash = small_cuckoo_split_hash });
+     for (uint64_t i = 0; i < N; i++) {
+          small_cuckoo_insert(&sc, i, ~i);
+          uint64_t h = small_cuckoo_split_hash(i, 0);
+          ++hash_quality_test[0][reduce(N<<1, h, 0)>>1];
+          ++hash_quality_test[1][reduce(N<<1, h>>32, 1)>>1];
+     }
+
+     int success = 1;
+     for (uint64_t i = 0; i < N; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, i, &v) && v == ~i;
+     }
+     ok(success, "all keys found with the split hash");
+     small_cuckoo_free(&sc);
+
+     double q[2];
+     for (int i = 0; i < 2; ++i) {
+          q[i] = evaluate_hash_quality(hash_quality_test[i], N);
+          note("estimated quality of half %d is %f\n", i+1, q[i]);
+     }
+     ok(q[0] > 0.5 && q[0] < 1.05 && q[1] > 0.5 && q[1] < 1.05, "both halves of the split hash acceptable");
+}
+
+/* Bit at a time CRC32C, to check the hardware path against. */
+static uint32_t crc32c_bitwise(uint64_t k)
+{
+     uint32_t h = ~0U;
+     for (int i = 0; i < 64; ++i, k >>= 1)
+          h = (h >> 1) ^ (0x82f63b78U & -((h ^ k) & 1));
+     return h;
+}
+
+void test_crc32_dispatch()
+{
+     note(__func__);
+
+     bool crc32 = false;
+#if defined(__x86_64__) && defined(__GNUC__)
+     crc32 = __builtin_cpu_supports("sse4.2");
+#endif
+     small_cuckoo sc = small_cuckoo_new(0);
+     int success = 1;
+     for (uint64_t k = 1; k < 1000; k += 7) {
+          uint64_t h = sc.hash ? sc.hash(k, 0) : small_cuckoo_default_hash(k, 0);
+          success &= !crc32 || (uint32_t)(h>>32) == crc32c_bitwise(k);
+          success &= h == small_cuckoo_default_hash(k, 0);
+     }
+     ok(success, "hash_2 is CRC32C whenever the CPU has it");
+     small_cuckoo_free(&sc);
+}
+
+void test_build()
+{
+     note(__func__);
+
+     enum { N = 5000 };
+     static uint64_t keys[N], values[N];
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+     }
+     small_cuckoo sc = small_cuckoo_build(keys, values, N);
+     ok(sc.n_entries == N+1 && sc.entries_len == N+1, "entries sized exactly");
+
+     int success = 1;
+     for (int i = 0; i < N; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, keys[i], &v) && v == values[i];
+     }
+     success &= !small_cuckoo_find(&sc, 0, NULL);
+     small_cuckoo_insert(&sc, 0, 17);
+     success &= small_cuckoo_find(&sc, 0, NULL);
+     ok(success, "all keys found in a bulk-built table, which still takes inserts");
+     small_cuckoo_free(&sc);
+}
+
+/* Look up keys[0..n) with both find and find_batch. */
+static int all_found(small_cuckoo *sc, const uint64_t *keys, const uint64_t *values, size_t n)
+{
+     enum { CHUNK = 1<<15 };
+     static uint64_t got[CHUNK], mask[CHUNK/64];
+     int success = 1;
+     for (size_t i = 0; i < n; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(sc, keys[i], &v) && v == values[i];
+     }
+     for (size_t base = 0; base < n; base += CHUNK) {
+          size_t m = n - base < CHUNK ? n - base : CHUNK;
+          small_cuckoo_find_batch(sc, keys+base, m, got, mask);
+          for (size_t i = 0; i < m; i++)
+               success &= (mask[i/64] >> (i%64) & 1) && got[i] == values[base+i];
+     }
+     return success;
+}
+
+void test_incremental_resize()
+{
+     note(__func__);
+
+     enum { N = 20000 };
+     static uint64_t keys[N], values[N];
+     small_cuckoo_opts opts = { .flags = SMALL_CUCKOO_INCREMENTAL };
+     small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+     int success = 1, migrations = 0;
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = ~i;
+          bool migrating = sc.old_table != NULL;
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+          /* Check each resize just after it starts and once midway. */
+          if (sc.old_table && (!migrating || sc.migrated == sc.old_table_size/2)) {
+               migrations += !migrating;
+               success &= all_found(&sc, keys, values, i+1);
+          }
+     }
+     note("%d incremental resizes", migrations);
+     ok(migrations > 0 && success, "keys found in both tables while resizing");
+
+     small_cuckoo_iter iter;
+     small_cuckoo_iterate(&sc, &iter);
+     int n = 0;
+     while (small_cuckoo_iter_has_next(&iter)) {
+          small_cuckoo_iter_next(&iter, NULL, NULL);
+          ++n;
+     }
+     ok(n == N && all_found(&sc, keys, values, N), "all keys found and iterated once afterwards");
+     small_cuckoo_free(&sc);
+}
+
+void test_realtime()
+{
+     note(__func__);
+
+     enum { N = 20000 };
+     static uint64_t keys[N], values[N];
+     small_cuckoo_opts opts = { .flags = SMALL_CUCKOO_REALTIME | SMALL_CUCKOO_INCREMENTAL };
+     small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+     int success = 1, checks = 0, max_queued = 0;
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+          if (sc.n_queued > max_queued) max_queued = sc.n_queued;
+          /* Check whenever something is queued, now and then. */
+          if (sc.n_queued && checks < 100) {
+               ++checks;
+               success &= all_found(&sc, keys, values, i+1);
+          }
+     }
+     note("queue held up to %d entries", max_queued);
+     ok(checks > 0 && success, "queued keys found");
+
+     small_cuckoo_iter iter;
+     small_cuckoo_iterate(&sc, &iter);
+     int n = 0;
+     while (small_cuckoo_iter_has_next(&iter)) {
+          small_cuckoo_iter_next(&iter, NULL, NULL);
+          ++n;
+     }
+     ok(n == N && all_found(&sc, keys, values, N), "all keys found and iterated once");
+     small_cuckoo_free(&sc);
+
+     /* Reserved up front, so entries[] is never copied and the table
+      * only replaced if the stash fills.  Apart from the inserts that
+      * replace it, each writes a slot per step of the walk and per
+      * entry migrated, bar the odd one handed to the breadth-first
+      * search, whose paths are bounded too. */
+     enum { M = 10000 };
+     sc = small_cuckoo_new_opts(0, &opts);
+     small_cuckoo_reserve(&sc, M);
+     small_cuckoo_slot *before = NULL;
+     void *entries = sc.entries;
+     unsigned most = 0, over = 0, replaced = 0;
+     for (uint64_t i = 0; i < M; i++) {
+          small_cuckoo_slot *table = sc.table;
+          size_t table_size = sc.table_size;
+          unsigned steps = REALTIME_STEPS + (sc.old_table ? MIGRATE_SLOTS : 0);
+          before = realloc(before, table_size * sizeof *before);
+          memcpy(before, table, table_size * sizeof *before);
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+          if (sc.table != table) {
+               ++replaced;
+               continue;
+          }
+          unsigned writes = 0;
+          for (size_t j = 0; j < table_size; ++j)
+               writes += before[j] != sc.table[j];
+          if (writes > most) most = writes;
+          over += writes > steps;
+     }
+     free(before);
+     note("at most %u slots written by one insert, %u wrote more than their steps, %u replaced the table",
+          most, over, replaced);
+     ok(sc.entries == entries && replaced <= 2 && over < M/100 &&
+        most <= REALTIME_STEPS + (MIGRATE_SLOTS+2) * (MAX_BFS_NODES+1),
+        "reserved: slots written per insert bounded outside resizes");
+     small_cuckoo_free(&sc);
+}
+
+void test_d_ary()
+{
+     note(__func__);
+
+     enum { N = 20000 };
+     static uint64_t keys[N], values[N];
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+     }
+     for (unsigned ways = 3; ways <= 4; ++ways) {
+          small_cuckoo_opts opts = { .ways = ways };
+          small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+          double load = 0;
+          for (int i = 0; i < N; i++) {
+               /* The load just before the last time the table grew. */
+               size_t table_size = sc.table_size;
+               small_cuckoo_insert(&sc, keys[i], values[i]);
+               if (sc.table_size > table_size)
+                    load = (double)(sc.n_entries-2) / table_size;
+          }
+          note("%u ways: grew at load %f", ways, load);
+          ok(load > 0.85 && all_found(&sc, keys, values, N), "%u ways: all keys found, load above 0.85 before growing", ways);
+          small_cuckoo_free(&sc);
+     }
+}
+
+/* Hopeless under the first seed, which crowds every key into eight
+ * rows, and split_hash() under any other, so a presized table reseeds
+ * early and then drains a well-filled old table. */
+static uint64_t crowded_at_first_seed(uint64_t key, uint32_t seed)
+{
+     uint64_t h = split_hash(key, seed);
+     return seed ? h : (h & 0x7) * 0x2000000020000000ULL;
+}
+
+void test_cached_hashes()
+{
+     note(__func__);
+
+     enum { N = 20000 };
+     static uint64_t keys[N], values[N];
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+     }
+     static const struct {
+          unsigned flags;
+          small_cuckoo_hash_fn *hash;
+          size_t initial_size;
+     } cases[] = {
+          { SMALL_CUCKOO_CACHE_HASHES, NULL, 0 },
+          { SMALL_CUCKOO_CACHE_HASHES | SMALL_CUCKOO_INCREMENTAL | SMALL_CUCKOO_REALTIME, NULL, 0 },
+          { SMALL_CUCKOO_CACHE_HASHES | SMALL_CUCKOO_INCREMENTAL, crowded_at_first_seed, N },
+     };
+     for (int f = 0; f < 3; ++f) {
+          small_cuckoo_opts opts = { .flags = cases[f].flags, .hash = cases[f].hash };
+          small_cuckoo sc = small_cuckoo_new_opts(cases[f].initial_size, &opts);
+          int success = 1;
+          unsigned stale = 0;
+          for (int i = 0; i < N; i++) {
+               small_cuckoo_insert(&sc, keys[i], values[i]);
+               if (i % 101) continue;
+               /* Only entries still waiting in a reseeded old table
+                * may hash under the old seed. */
+               for (entry_index j = 1; j < sc.n_entries; ++j) {
+                    uint64_t key = sc.entries[j].key;
+                    if (sc.hashes[j] == full_hash(&sc, sc.seed, key)) continue;
+                    size_t h[MAX_WAYS];
+                    ++stale;
+                    success &= sc.old_table && sc.old_seed != sc.seed;
+                    if (!sc.old_table) break;
+                    slots_in(&sc, sc.old_table_size, sc.old_seed, key, h);
+                    success &= find_in_table(&sc, sc.old_table, key, h) == j;
+               }
+          }
+          note("%u stale hashes seen in old tables", stale);
+          ok(success && all_found(&sc, keys, values, N),
+             "hashes cached under the current seed but in old tables, all keys found (case %d)", f);
+          small_cuckoo_free(&sc);
+     }
+}
+
+void test_upsert()
+{
+     note(__func__);
+
+     enum { N = 3000, ROUNDS = 5 };
+     static const unsigned flags[] = { 0, SMALL_CUCKOO_REALTIME | SMALL_CUCKOO_INCREMENTAL };
+     for (int f = 0; f < 2; ++f) {
+          small_cuckoo_opts opts = { .flags = flags[f] };
+          small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+          for (int r = 0; r < ROUNDS; ++r)
+               for (uint64_t i = 0; i < N; ++i) {
+                    uint64_t key = fnv_hash((uint8_t *)&i, 8);
+                    ++*small_cuckoo_find_or_insert(&sc, key, 0);
+                    if (i % 3 == 0) small_cuckoo_upsert(&sc, key ^ 1, r);
+               }
+          int success = sc.n_entries == 1 + N + (N+2)/3;
+          for (uint64_t i = 0; i < N; ++i) {
+               uint64_t key = fnv_hash((uint8_t *)&i, 8), v;
+               success &= small_cuckoo_find(&sc, key, &v) && v == ROUNDS;
+               if (i % 3 == 0) success &= small_cuckoo_find(&sc, key ^ 1, &v) && v == ROUNDS-1;
+          }
+          ok(success, "each key stored once and updated in place (flags %#x)", flags[f]);
+          small_cuckoo_free(&sc);
+     }
+}
+
+void test_erase()
+{
+     note(__func__);
+
+     enum { N = 10000 };
+     static uint64_t keys[N], values[N];
+     static const unsigned flags[] = {
+          0, SMALL_CUCKOO_CACHE_HASHES, SMALL_CUCKOO_REALTIME | SMALL_CUCKOO_INCREMENTAL
+     };
+     for (int f = 0; f < 3; ++f) {
+          small_cuckoo_opts opts = { .flags = flags[f] };
+          small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+          int success = 1;
+          /* Erase every other key as we go, so some go from the
+           * queue, the stash or a table being drained. */
+          for (uint64_t i = 0; i < N; i++) {
+               keys[i] = fnv_hash((uint8_t *)&i, 8);
+               values[i] = i;
+               small_cuckoo_insert(&sc, keys[i], values[i]);
+               if (i % 2) success &= small_cuckoo_erase(&sc, keys[i-1]);
+          }
+          success &= !small_cuckoo_erase(&sc, keys[0]);
+          success &= sc.n_entries == 1 + N/2;
+          for (int i = 0; i < N; i++) {
+               uint64_t v;
+               bool found = small_cuckoo_find(&sc, keys[i], &v);
+               success &= i % 2 ? found && v == values[i] : !found;
+          }
+          ok(success, "erased keys gone, the rest intact (flags %#x)", flags[f]);
+
+          size_t grown = sc.table_size;
+          for (int i = 1; i < N-10; i += 2)
+               success &= small_cuckoo_erase(&sc, keys[i]);
+          success &= sc.n_entries == 1 + 5;
+          for (int i = N-9; i < N; i += 2)
+               success &= small_cuckoo_find(&sc, keys[i], NULL);
+          note("table went from %zu to %zu slots", grown, sc.table_size);
+          ok(success && sc.table_size < grown/16, "table shrinks as it empties (flags %#x)", flags[f]);
+          small_cuckoo_free(&sc);
+     }
+}
+
+void test_reserve()
+{
+     note(__func__);
+
+     enum { N = 6000 };
+     static uint64_t keys[N], values[N];
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+     }
+     small_cuckoo sc = small_cuckoo_new(0);
+     small_cuckoo_insert(&sc, keys[0], values[0]);
+     small_cuckoo_reserve(&sc, N);
+     size_t table_size = sc.table_size;
+     void *entries = sc.entries;
+     for (int i = 1; i < N; i++)
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+     ok(sc.table_size == table_size && sc.entries == entries && all_found(&sc, keys, values, N),
+        "no growth or reallocation after reserving");
+     small_cuckoo_free(&sc);
+
+     sc = small_cuckoo_new(8*N);
+     for (int i = 0; i < N; i++)
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+     table_size = sc.table_size;
+     small_cuckoo_shrink_to_fit(&sc);
+     note("shrank from %zu to %zu slots", table_size, sc.table_size);
+     int success = sc.table_size < table_size && sc.entries_len == sc.n_entries;
+     success &= all_found(&sc, keys, values, N);
+     small_cuckoo_insert(&sc, 0, 1);
+     success &= small_cuckoo_find(&sc, 0, NULL);
+     ok(success, "shrunk to fit, all keys found, still takes inserts");
+     small_cuckoo_free(&sc);
+}
+
+void test_growth()
+{
+     note(__func__);
+
+     enum { N = 20000 };
+     static uint64_t keys[N], values[N];
+     small_cuckoo sc = small_cuckoo_new(0);
+     size_t table_size = sc.table_size;
+     int success = 1;
+     double min_load = 1;
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+          if (sc.table_size == table_size) continue;
+          success &= 2*sc.table_size <= 3*table_size + 2*sc.ways;
+          double load = (double)(sc.n_entries-1) / sc.table_size;
+          if (table_size > 64 && load < min_load) min_load = load;
+          table_size = sc.table_size;
+     }
+     note("ended at %zu slots, lowest load after growing %f", sc.table_size, min_load);
+     ok(success && (sc.table_size & (sc.table_size-1)), "tables grow by half, not to powers of two");
+     ok(all_found(&sc, keys, values, N) && min_load > 0.25, "all keys found, load stays above 0.25");
+     small_cuckoo_free(&sc);
+}
+
+/* Keys that differ only above bit 32, such as IDs in a high word:
+ * hash_1 must still spread them, since slots come from its high bits. */
+void test_high_bit_keys()
+{
+     note(__func__);
+
+     enum { N = 20000 };
+     static uint64_t keys[N], values[N], mask[N/64+1];
+     for (unsigned shift = 32; shift <= 40; shift += 8) {
+          small_cuckoo sc = small_cuckoo_new(0);
+          for (uint64_t i = 0; i < N; i++) {
+               keys[i] = (i+1) << shift;
+               values[i] = i;
+               small_cuckoo_insert(&sc, keys[i], values[i]);
+          }
+          double load = (double)(sc.n_entries-1) / sc.table_size;
+          note("keys i<<%u: %u kept in %zu slots", shift, sc.n_entries-1, sc.table_size);
+          small_cuckoo_find_batch(&sc, keys, N, NULL, mask);
+          int success = 1;
+          for (int i = 0; i < N; i++)
+               success &= !!(mask[i/64] & (1ULL << (i%64)));
+          ok(sc.n_entries-1 == N && load > 0.25 && all_found(&sc, keys, values, N) && success,
+             "keys differing above bit 32 all kept, load above 0.25 (shift %u)", shift);
+          small_cuckoo_free(&sc);
+     }
+}
+
+/* Sixteen keys in a row share each hash pair, whatever the seed. */
+static uint64_t shared_pair_hash(uint64_t key, uint32_t seed)
+{
+     return small_cuckoo_default_hash(key / 16, seed);
+}
+
+/* Every entry left is findable with its value, and the table didn't
+ * grow without bound to keep the ones given up. */
+static bool given_up_consistently(small_cuckoo *sc)
+{
+     bool success = sc->table_size <= max_table_size(sc);
+     for (size_t i = 1; i < sc->n_entries; ++i) {
+          uint64_t v;
+          success &= small_cuckoo_find(sc, sc->entries[i].key, &v) && v == sc->entries[i].value;
+     }
+     return success;
+}
+
+void test_given_up()
+{
+     note(__func__);
+
+     /* With a realtime walk or an incremental resize under way, the
+      * entry given up may be an older one, so count what is left
+      * rather than what each call reported. */
+     enum { N = 1000, OTHERS = 32 };
+     static const unsigned flags[] = { 0, SMALL_CUCKOO_INCREMENTAL | SMALL_CUCKOO_REALTIME };
+     for (int f = 0; f < 2; ++f) {
+          small_cuckoo_opts opts = { .flags = flags[f] };
+          small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+          for (uint64_t i = 1; i <= OTHERS; i++)
+               small_cuckoo_insert(&sc, fnv_hash((uint8_t *)&i, 8), i);
+          unsigned refused = 0;
+          for (int i = 0; i < N; i++)
+               refused += !small_cuckoo_insert(&sc, 42, 42);
+          bool success = refused > 0 && sc.n_entries-1 < OTHERS + N && small_cuckoo_find(&sc, 42, NULL);
+          note("kept %u of %d copies in %zu slots", sc.n_entries-1 - OTHERS, N, sc.table_size);
+          ok(success && given_up_consistently(&sc),
+             "one key over and over: copies given up, table bounded (flags %#x)", flags[f]);
+          small_cuckoo_free(&sc);
+
+          opts.hash = shared_pair_hash;
+          sc = small_cuckoo_new_opts(0, &opts);
+          for (uint64_t i = 1; i <= N; i++)
+               small_cuckoo_find_or_insert(&sc, i, i);
+          unsigned found = 0;
+          for (uint64_t i = 1; i <= N; i++)
+               found += small_cuckoo_find(&sc, i, NULL);
+          note("kept %u of %d keys in %zu slots", found, N, sc.table_size);
+          ok(found == sc.n_entries-1u && found < N && given_up_consistently(&sc),
+             "keys sharing hash pairs: given up, table bounded (flags %#x)", flags[f]);
+          small_cuckoo_free(&sc);
+
+          /* Distinct keys are never given up, however alike. */
+          enum { M = 20000 };
+          opts.hash = NULL;
+          sc = small_cuckoo_new_opts(0, &opts);
+          success = true;
+          for (uint64_t i = 1; i <= M; i++)
+               success &= small_cuckoo_insert(&sc, i<<32, i);
+          for (uint64_t i = 1; i <= M; i++) {
+               uint64_t v;
+               success &= small_cuckoo_find(&sc, i<<32, &v) && v == i;
+          }
+          ok(success && sc.n_entries-1 == M, "distinct keys i<<32 all kept (flags %#x)", flags[f]);
+          small_cuckoo_free(&sc);
+     }
+}
+
+/* Allocator hooks that check the sizes they are given against a
+ * header in front of each block. */
+struct counted {
+     size_t live, calls;
+     bool sizes_match;
+};
+
+static void *counted_alloc(void *ctx, size_t size)
+{
+     struct counted *c = ctx;
+     ++c->calls;
+     c->live += size;
+     size_t *p = malloc(16 + size);
+     *p = size;
+     return (char *)p + 16;
+}
+
+static void counted_free(void *ctx, void *p, size_t size)
+{
+     struct counted *c = ctx;
+     size_t *q = (size_t *)((char *)p - 16);
+     c->sizes_match &= *q == size;
+     c->live -= size;
+     free(q);
+}
+
+static void *counted_realloc(void *ctx, void *p, size_t old_size, size_t new_size)
+{
+     void *q = counted_alloc(ctx, new_size);
+     memcpy(q, p, old_size < new_size ? old_size : new_size);
+     counted_free(ctx, p, old_size);
+     return q;
+}
+
+void test_allocator()
+{
+     note(__func__);
+
+     enum { N = 6000 };
+     static uint64_t keys[N], values[N];
+     struct counted c = { .sizes_match = true };
+     small_cuckoo_allocator a = { counted_alloc, counted_realloc, counted_free, &c };
+     small_cuckoo_opts opts = {
+          .flags = SMALL_CUCKOO_INCREMENTAL | SMALL_CUCKOO_CACHE_HASHES, .allocator = &a
+     };
+     small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+     }
+     ok(all_found(&sc, keys, values, N) && c.calls > 2, "all keys found with %zu allocations", c.calls);
+     for (int i = 0; i < N/2; i++)
+          small_cuckoo_erase(&sc, keys[i]);
+     small_cuckoo_shrink_to_fit(&sc);
+     small_cuckoo_free(&sc);
+     ok(c.live == 0 && c.sizes_match, "everything given back, with the sizes it was allocated with");
+
+     c = (struct counted){ .sizes_match = true };
+     sc = small_cuckoo_build_opts(keys, values, N, &opts);
+     int success = c.calls > 2 && c.live > 0 && all_found(&sc, keys, values, N);
+     small_cuckoo_insert(&sc, 0, 17);
+     success &= small_cuckoo_find(&sc, 0, NULL);
+     small_cuckoo_free(&sc);
+     ok(success && c.live == 0 && c.sizes_match, "bulk build allocates through the allocator too");
+}
+
+void test_mapped()
+{
+     note(__func__);
+
+     enum { N = 30000 };
+     static uint64_t keys[N], values[N];
+     small_cuckoo_opts opts = { .flags = SMALL_CUCKOO_HUGE_PAGES | SMALL_CUCKOO_PREFAULT };
+     small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+     }
+     int success = all_found(&sc, keys, values, N);
+     success &= (uintptr_t)sc.table % HUGE_PAGE_SIZE == 0 && (uintptr_t)sc.entries % HUGE_PAGE_SIZE == 0;
+     for (int i = 0; i < N/2; i++)
+          small_cuckoo_erase(&sc, keys[i]);
+     success &= all_found(&sc, keys+N/2, values+N/2, N/2);
+     ok(success, "huge-page table aligned, all keys found through growing and shrinking");
+
+     FILE *f = tmpfile();
+     small_cuckoo_serialize(fileno(f), &sc);
+     small_cuckoo_free(&sc);
+     rewind(f);
+     opts.flags = SMALL_CUCKOO_PREFAULT | SMALL_CUCKOO_MLOCK | SMALL_CUCKOO_CACHE_HASHES;
+     small_cuckoo_deserialize_opts(fileno(f), &sc, &opts);
+     fclose(f);
+     ok(sc.hashes && all_found(&sc, keys+N/2, values+N/2, N/2), "deserialized with options, all keys found");
+     small_cuckoo_free(&sc);
+}
+
+#ifdef SMALL_CUCKOO_WIDE
+void test_wide()
+{
+     note(__func__);
+
+     enum { N = 200000 };
+     static uint64_t keys[N], values[N];
+     small_cuckoo sc = small_cuckoo_new(0);
+     for (uint64_t i = 0; i < N; i++) {
+          keys[i] = fnv_hash((uint8_t *)&i, 8);
+          values[i] = i;
+          small_cuckoo_insert(&sc, keys[i], values[i]);
+     }
+     note("%u entries in %zu slots", sc.n_entries-1, sc.table_size);
+     ok(sc.n_entries == N+1 && all_found(&sc, keys, values, N), "more than 64k keys, all found");
+     small_cuckoo_free(&sc);
+}
+#endif
+
+/* One writer, which fills a table and then churns its first half,
+ * and readers checking that the second half is always there. */
+enum { CONCURRENT_N = 20000, N_READERS = 3 };
+
+static struct {
+     small_cuckoo sc;
+     uint64_t keys[CONCURRENT_N];
+     size_t published;          /* Keys the writer has finished inserting. */
+     uint64_t lookups;
+     bool done;
+     unsigned failures;
+} shared;
+
+static void *concurrent_reader(void *arg)
+{
+     uint64_t state = (uintptr_t)arg;
+     unsigned failures = 0;
+     while (!__atomic_load_n(&shared.done, __ATOMIC_ACQUIRE)) {
+          size_t n = __atomic_load_n(&shared.published, __ATOMIC_ACQUIRE);
+          if (n <= CONCURRENT_N/2) continue;
+          state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+          size_t j = CONCURRENT_N/2 + (state>>33) % (n - CONCURRENT_N/2);
+          uint64_t v;
+          failures += !small_cuckoo_find(&shared.sc, shared.keys[j], &v) || v != j;
+          failures += small_cuckoo_find(&shared.sc, ~shared.keys[j], NULL);
+          if (__atomic_add_fetch(&shared.lookups, 1, __ATOMIC_RELAXED) % 16 == 0)
+               sched_yield();
+     }
+     __atomic_add_fetch(&shared.failures, failures, __ATOMIC_RELAXED);
+     return NULL;
+}
+
+/* Let the readers in every so often, even on one CPU. */
+static void let_readers_in(size_t op)
+{
+     if (op % 64 || __atomic_load_n(&shared.published, __ATOMIC_RELAXED) <= CONCURRENT_N/2) return;
+     uint64_t target = __atomic_load_n(&shared.lookups, __ATOMIC_RELAXED) + 16;
+     while (__atomic_load_n(&shared.lookups, __ATOMIC_RELAXED) < target)
+          sched_yield();
+}
+
+void test_concurrent()
+{
+     note(__func__);
+
+     static const unsigned flags[] = {
+          SMALL_CUCKOO_CONCURRENT,
+          SMALL_CUCKOO_CONCURRENT | SMALL_CUCKOO_INCREMENTAL | SMALL_CUCKOO_REALTIME | SMALL_CUCKOO_CACHE_HASHES
+     };
+     for (int f = 0; f < 2; ++f) {
+          small_cuckoo_opts opts = { .flags = flags[f] };
+          shared.sc = small_cuckoo_new_opts(0, &opts);
+          shared.published = 0;
+          shared.done = false;
+          shared.lookups = shared.failures = 0;
+          for (uint64_t i = 0; i < CONCURRENT_N; i++)
+               shared.keys[i] = fnv_hash((uint8_t *)&i, 8);
+          pthread_t readers[N_READERS];
+          for (uintptr_t r = 0; r < N_READERS; ++r)
+               ENSURE(0 == pthread_create(&readers[r], NULL, concurrent_reader, (void *)(r+1)));
+
+          /* Only the second half need be in place before readers look. */
+          for (size_t i = CONCURRENT_N; i-- > 0; ) {
+               small_cuckoo_insert(&shared.sc, shared.keys[i], i);
+               __atomic_store_n(&shared.published, CONCURRENT_N - i, __ATOMIC_RELEASE);
+               let_readers_in(i);
+          }
+          for (int round = 0; round < 4; ++round)
+               for (size_t i = 0; i < CONCURRENT_N/2; ++i) {
+                    small_cuckoo_erase(&shared.sc, shared.keys[i]);
+                    small_cuckoo_upsert(&shared.sc, shared.keys[i], i);
+                    let_readers_in(i);
+               }
+          __atomic_store_n(&shared.done, true, __ATOMIC_RELEASE);
+          for (int r = 0; r < N_READERS; ++r)
+               pthread_join(readers[r], NULL);
+          note("%llu lookups, %u failed", (unsigned long long)shared.lookups, shared.failures);
+          ok(shared.failures == 0 && shared.sc.retired, "readers never miss a key while the writer grows the table (flags %#x)", flags[f]);
+
+          small_cuckoo_reclaim(&shared.sc);
+          int success = !shared.sc.retired && shared.sc.retired_before;
+          small_cuckoo_reclaim(&shared.sc);
+          success &= !shared.sc.retired_before;
+          for (size_t i = 0; i < CONCURRENT_N; i++) {
+               uint64_t v;
+               success &= small_cuckoo_find(&shared.sc, shared.keys[i], &v) && v == i;
+          }
+          ok(success, "all keys there after reclaiming (flags %#x)", flags[f]);
+          small_cuckoo_free(&shared.sc);
+     }
+}
+
+/* A hash that holds up the lookup of PAUSE_KEY once armed, after the
+ * reader has taken its snapshot and before it probes the arrays. */
+enum { PAUSE_IDLE, PAUSE_ARMED, PAUSE_HELD, PAUSE_RELEASED };
+static const uint64_t PAUSE_KEY = 0xdeadbeefcafef00dULL;
+static int pause_state;
+
+static uint64_t pausing_hash(uint64_t key, uint32_t seed)
+{
+     int armed = PAUSE_ARMED;
+     if (key == PAUSE_KEY &&
+         __atomic_compare_exchange_n(&pause_state, &armed, PAUSE_HELD, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+          while (__atomic_load_n(&pause_state, __ATOMIC_ACQUIRE) != PAUSE_RELEASED)
+               sched_yield();
+     return split_hash(key, seed);
+}
+
+static void *paused_reader(void *arg)
+{
+     return (void *)(uintptr_t)small_cuckoo_find(arg, PAUSE_KEY, NULL);
+}
+
+void test_reclaim_generations()
+{
+     note(__func__);
+
+     /* Mapped blocks are unmapped when freed, so a reader probing a
+      * freed table faults rather than reading stale memory. */
+     enum { N = 20000 };
+     small_cuckoo_opts opts = {
+          .hash = pausing_hash,
+          .flags = SMALL_CUCKOO_CONCURRENT | SMALL_CUCKOO_PREFAULT
+     };
+     small_cuckoo sc = small_cuckoo_new_opts(0, &opts);
+     for (uint64_t i = 0; i < N; i++)
+          small_cuckoo_insert(&sc, fnv_hash((uint8_t *)&i, 8), i);
+     small_cuckoo_reclaim(&sc);
+
+     pause_state = PAUSE_ARMED;
+     pthread_t reader;
+     ENSURE(0 == pthread_create(&reader, NULL, paused_reader, &sc));
+     while (__atomic_load_n(&pause_state, __ATOMIC_ACQUIRE) != PAUSE_HELD)
+          sched_yield();
+     /* The lookup began after the first reclaim, so the second may be
+      * called now, but must keep what the reserve replaces under it. */
+     void *table = sc.table, *entries = sc.entries;
+     small_cuckoo_reserve(&sc, 2*N);
+     small_cuckoo_reclaim(&sc);
+     bool kept = false;
+     for (struct small_cuckoo_retired *r = sc.retired_before; r; r = r->next)
+          kept |= r->p == table || r->p == entries;
+     __atomic_store_n(&pause_state, PAUSE_RELEASED, __ATOMIC_RELEASE);
+     void *found;
+     pthread_join(reader, &found);
+     ok(kept && !found, "arrays retired under a running lookup outlive the next reclaim");
+
+     small_cuckoo_reclaim(&sc);
+     small_cuckoo_reclaim(&sc);
+     bool success = !sc.retired && !sc.retired_before;
+     for (uint64_t i = 0; i < N; i++) {
+          uint64_t v;
+          success &= small_cuckoo_find(&sc, fnv_hash((uint8_t *)&i, 8), &v) && v == i;
+     }
+     ok(success, "two more reclaims free everything, all keys found");
+     small_cuckoo_free(&sc);
+}
+
+int main()
+{
+     struct {
+          void (*fn)();
+          int count;
+     } tests[] = {
+          {test_basic_ops_randomized, 4},
+          {test_basic_ops_incremental, 4},
+          {test_find_batch, 2},
+          {test_serialize_roundtrip, 1},
+          {test_stash, 3},
+          {test_reseed, 2},
+          {test_custom_hash, 2},
+          {test_split_hash, 2},
+          {test_crc32_dispatch, 1},
+          {test_build, 2},
+          {test_incremental_resize, 2},
+          {test_realtime, 3},
+          {test_d_ary, 2},
+          {test_cached_hashes, 3},
+          {test_upsert, 2},
+          {test_erase, 6},
+          {test_reserve, 2},
+          {test_growth, 2},
+          {test_high_bit_keys, 2},
+          {test_given_up, 6},
+          {test_allocator, 3},
+          {test_mapped, 2},
+          {test_concurrent, 4},
+          {test_reclaim_generations, 2},
+#ifdef SMALL_CUCKOO_WIDE
+          {test_wide, 1},
+#endif
      };
 
      int i, count = 0, n = (sizeof tests)/(sizeof tests[0]);
@@ -1,5 +1,6 @@
 /** -*- mode: C; c-file-style: "k&r" -*-
- * Implements memory-mappable Cuckoo hash table for less than 64k keys.
+ * Implements memory-mappable Cuckoo hash table for less than 64k keys;
+ * see small-cuckoo32.h for more.
  * @file small-cuckoo.h
  */
 #pragma once
@@ -8,31 +9,237 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A table slot: 0 if empty, otherwise an index into @c entries.
+ * Building with SMALL_CUCKOO_FINGERPRINT widens slots to 32 bits,
+ * the high half holding a tag of the key, so most lookups of absent
+ * keys are decided without touching @c entries. */
+#ifdef SMALL_CUCKOO_FINGERPRINT
+typedef uint32_t small_cuckoo_slot;
+#define SMALL_CUCKOO_LAYOUT small_cuckoo_layout_fingerprint
+#else
+typedef uint16_t small_cuckoo_slot;
+#define SMALL_CUCKOO_LAYOUT small_cuckoo_layout_plain
+#endif
+
+/* Slots, and so the tables below, change size with
+ * SMALL_CUCKOO_FINGERPRINT.  The library defines the symbol for the
+ * layout it was built with and every file including this refers to
+ * it, so mixing the two fails to link instead of corrupting memory. */
+extern const char SMALL_CUCKOO_LAYOUT;
+static const char *const small_cuckoo_layout_check __attribute__((used)) = &SMALL_CUCKOO_LAYOUT;
+
+/** Entries for which no short enough chain of displacements exists are
+ * parked in a small stash, checked on every unsuccessful lookup;
+ * the table only grows once the stash is full. */
+enum { SMALL_CUCKOO_STASH_SIZE = 4 };
+
+/** Entries not yet placed by a SMALL_CUCKOO_REALTIME table wait in a
+ * queue, also checked on every unsuccessful lookup. */
+enum { SMALL_CUCKOO_QUEUE_SIZE = 16 };
+
+/** Two independent 32-bit hashes of @a key, hash_1's in the low half.
+ * Slots are picked from the *high* bits of each half, by fastrange
+ * (multiply by the row count, keep the top 32 bits), so those are the
+ * bits that must be uniform; a hash whose entropy sits in its low bits
+ * puts every key in the first few rows.  @a seed must change which
+ * keys collide, not just offset the result, or reseeding can't break
+ * eviction cycles. */
+typedef uint64_t small_cuckoo_hash_fn(uint64_t key, uint32_t seed);
+
+enum small_cuckoo_flags {
+     /** Grow a few slots at a time on each insert, probing the old and
+      * new tables in the meantime, instead of rebuilding all at once
+      * inside one unlucky insert.  Cached hashes catch up with a new
+      * seed the same way.  What is still done all at once is
+      * allocating the new table and doubling entries[], which copies
+      * it: tens to hundreds of microseconds at tens of thousands of
+      * keys.  So the work per insert is only bounded between those;
+      * small_cuckoo_reserve does them up front. */
+     SMALL_CUCKOO_INCREMENTAL = 1<<0,
+     /** Queue each new entry and do a fixed few displacements per
+      * insert, after Arbitman, Naor and Segev, so no insert does more
+      * than a bounded amount of work; best with
+      * SMALL_CUCKOO_INCREMENTAL, so growing is bounded too.  Not
+      * bounded: starting to grow (allocating the new table, or
+      * rebuilding everything if a cycle hits while one resize is
+      * still draining) and doubling entries[]; small_cuckoo_reserve
+      * avoids both, bar a cycle. */
+     SMALL_CUCKOO_REALTIME = 1<<1,
+     /** Keep each entry's hash pair alongside it, so moving entries
+      * and growing the table never hash keys again; 8 bytes more per
+      * entry. */
+     SMALL_CUCKOO_CACHE_HASHES = 1<<2,
+     /** Map blocks of 64KB or more (the table, and entries[] once it
+      * is that big) in 2MB-aligned transparent huge pages, so random
+      * probes miss the TLB less.  Each such block takes at least 2MB. */
+     SMALL_CUCKOO_HUGE_PAGES = 1<<3,
+     /** Fault in mapped blocks as they are allocated, so the first
+      * lookups after growing or loading a table don't take the page
+      * faults instead. */
+     SMALL_CUCKOO_PREFAULT = 1<<4,
+     /** mlock mapped blocks too, where RLIMIT_MEMLOCK allows; a block
+      * that can't be locked is still used. */
+     SMALL_CUCKOO_MLOCK = 1<<5,
+     /** Let any number of threads call small_cuckoo_find while one
+      * writer changes the table.  Readers take no lock: they retry
+      * if @c version says the writer was busy, and arrays the writer
+      * replaces are kept until it calls small_cuckoo_reclaim. */
+     SMALL_CUCKOO_CONCURRENT = 1<<6,
+};
+
+/** Where a table gets its memory, say from an arena or shared
+ * memory.  All three functions are given @a ctx; @a realloc and
+ * @a free are also given the size of the block, so an arena needn't
+ * track it.  Blocks need only malloc's alignment.  Running out of
+ * memory is reported by returning NULL, which is fatal as it is with
+ * malloc. */
+typedef struct small_cuckoo_allocator {
+     void *(*alloc)(void *ctx, size_t size);
+     void *(*realloc)(void *ctx, void *p, size_t old_size, size_t new_size);
+     void (*free)(void *ctx, void *p, size_t size);
+     void *ctx;
+} small_cuckoo_allocator;
+
+typedef struct small_cuckoo_opts {
+     small_cuckoo_hash_fn *hash; /* NULL for the built-in pair. */
+     unsigned flags;            /* Of enum small_cuckoo_flags. */
+     /** Slots per key: 2 (the default, if 0), 3 or 4.  More choices
+      * let the table fill to about 90% rather than 50% before it
+      * grows, at the cost of probing them all on a miss. */
+     unsigned ways;
+     /** Copied into the table, so it need not outlive the call; NULL
+      * for malloc, realloc and free, or for mmap with any of
+      * SMALL_CUCKOO_HUGE_PAGES, SMALL_CUCKOO_PREFAULT and
+      * SMALL_CUCKOO_MLOCK, which can't be combined with one. */
+     const small_cuckoo_allocator *allocator;
+} small_cuckoo_opts;
+
+/* small_cuckoo32 mirrors this with wider indices; keep them in step. */
 typedef struct small_cuckoo {
      size_t table_size;
-     uint16_t *table;
+     small_cuckoo_slot *table;
+     uint32_t seed;             /* Changed on rehash to escape cycles. */
+     uint8_t ways;              /* Slots per key; slot c of row r is ways*r + c. */
+     small_cuckoo_hash_fn *hash;
+     unsigned flags;
+     /* While resizing incrementally: the table being drained, and how
+      * many of its slots have been moved to @c table so far. */
+     small_cuckoo_slot *old_table;
+     size_t old_table_size, migrated;
+     uint32_t old_seed;
+     small_cuckoo_slot stash[SMALL_CUCKOO_STASH_SIZE];
+     uint8_t n_stashed;
+     /* The entry at the head of the queue is the one being walked;
+      * walk_len counts its displacements so far, and walk_choice
+      * says which of its slots it was last evicted from. */
+     small_cuckoo_slot queue[SMALL_CUCKOO_QUEUE_SIZE];
+     uint8_t queue_head, n_queued, walk_len, walk_choice;
      uint16_t n_entries, entries_len;
      struct {
           uint64_t key;
           uint64_t value;
      } *entries;
+     uint64_t *hashes;          /* Hash pair of each entry under seed, or NULL. */
+     small_cuckoo_allocator allocator; /* All NULL for malloc. */
+     /* With SMALL_CUCKOO_CONCURRENT: odd while the writer is changing
+      * the table, the arrays it has replaced since reclaiming, and
+      * those it replaced before that, freed by the next reclaim. */
+     uint32_t version;
+     struct small_cuckoo_retired *retired, *retired_before;
 } small_cuckoo;
 
 typedef struct small_cuckoo_iter {
      small_cuckoo *sc;
-     uint16_t i;
+     size_t i;
 } small_cuckoo_iter;
 
+#ifdef SMALL_CUCKOO_STATS
+/** Counts of displacement paths taken by insertions, across all
+ * tables; only kept in builds with SMALL_CUCKOO_STATS. */
+extern struct small_cuckoo_stats {
+     uint64_t placements;       /* Entries put in the table. */
+     uint64_t moves;            /* Slot writes, including the new entry's. */
+     unsigned max_moves;
+} small_cuckoo_stats;
+#endif
+
 extern small_cuckoo small_cuckoo_new(size_t initial_size);
-extern void small_cuckoo_insert(small_cuckoo *sc, uint64_t key, uint64_t value);
+extern small_cuckoo small_cuckoo_new_opts(size_t initial_size, const small_cuckoo_opts *opts);
+/** Build a table of @a n distinct keys in one go, sizing it once;
+ * @a values may be NULL for all zeroes. */
+extern small_cuckoo small_cuckoo_build(const uint64_t *keys, const uint64_t *values, size_t n);
+/** small_cuckoo_build with the options of small_cuckoo_new_opts. */
+extern small_cuckoo small_cuckoo_build_opts(const uint64_t *keys, const uint64_t *values, size_t n,
+                                            const small_cuckoo_opts *opts);
+/** Add @a key, even if it is there already.  Returns false if the
+ * table had to give up an entry rather than grow to many times the
+ * size its entries need, which only happens to entries whose hash
+ * pair another entry has exactly: one key inserted over and over, or
+ * a hash function that can't tell keys apart.  The entry given up is
+ * dropped as if erased; it is this one unless an older one sharing
+ * its pair was waiting in the stash or a realtime walk.  Keys with
+ * distinct pairs are never given up: if even a much larger table
+ * can't place them, the hash function is broken and this aborts. */
+extern bool small_cuckoo_insert(small_cuckoo *sc, uint64_t key, uint64_t value);
+/** Make room for @a n keys in all, so inserting up to that many
+ * neither grows the table nor reallocates the entries. */
+extern void small_cuckoo_reserve(small_cuckoo *sc, size_t n);
+/** Cut the table and entries down to the smallest that hold what is
+ * there now, say after loading a table that won't change much. */
+extern void small_cuckoo_shrink_to_fit(small_cuckoo *sc);
+/** Pointer to the value of @a key, inserting it with @a value first if
+ * it is missing.  Hashes @a key once; the pointer is good until the
+ * next insertion.  NULL if @a key was given up, as with
+ * small_cuckoo_insert. */
+extern uint64_t *small_cuckoo_find_or_insert(small_cuckoo *sc, uint64_t key, uint64_t value);
+/** Set the value of @a key to @a value, inserting it if it is missing,
+ * and return a pointer to it as small_cuckoo_find_or_insert does. */
+extern uint64_t *small_cuckoo_upsert(small_cuckoo *sc, uint64_t key, uint64_t value);
+/** Safe to call from any thread of a SMALL_CUCKOO_CONCURRENT table,
+ * as are small_cuckoo_find_hashed and small_cuckoo_find_batch, which
+ * fall back to it there.  Everything else belongs to the writer. */
 extern bool small_cuckoo_find(small_cuckoo *sc, uint64_t key, uint64_t *value);
+/** Remove @a key, returning whether it was there.  The last entry
+ * moves into its place, so entries[] stays dense and iterators are
+ * invalidated; the table halves once it is mostly empty. */
+extern bool small_cuckoo_erase(small_cuckoo *sc, uint64_t key);
+/** Look up @a key given @a hash, its hash pair under @c sc->seed, so
+ * callers with the hash function inlined needn't call through
+ * @c sc->hash. */
+extern bool small_cuckoo_find_hashed(small_cuckoo *sc, uint64_t key, uint64_t hash, uint64_t *value);
+/** The pair used when no hash function is given: Larson's hash, and
+ * CRC32 or Bob Jenkins's hash depending on the build. */
+extern uint64_t small_cuckoo_default_hash(uint64_t key, uint32_t seed);
+/** A single 64-bit mix whose halves give both slots: cheaper than the
+ * default pair and inlined by the engine when passed as
+ * small_cuckoo_opts.hash. */
+extern uint64_t small_cuckoo_split_hash(uint64_t key, uint32_t seed);
+/** Look up @a n keys at once, overlapping their cache misses.  Bit
+ * @c j of @a found_mask (an array of (n+63)/64 words) is set iff
+ * @c keys[j] is present, in which case @c values[j] is filled in. */
+extern void small_cuckoo_find_batch(small_cuckoo *sc, const uint64_t *keys, size_t n,
+                                    uint64_t *values, uint64_t *found_mask);
+/** Free the arrays a SMALL_CUCKOO_CONCURRENT table had replaced by
+ * the previous call; those replaced since are kept for the next one.
+ * Only the writer may call it, once every lookup begun before the
+ * previous call has returned, say after an RCU grace period.  Tables
+ * reclaimed regularly hold about two tables' worth more memory. */
+extern void small_cuckoo_reclaim(small_cuckoo *sc);
 extern void small_cuckoo_free(small_cuckoo *sc);
 extern void small_cuckoo_serialize(int fd, small_cuckoo *sc);
 extern void small_cuckoo_deserialize(int fd, small_cuckoo *sc);
+/** Deserialize into a table built as small_cuckoo_new_opts would;
+ * only the entries are stored, so any options will do. */
+extern void small_cuckoo_deserialize_opts(int fd, small_cuckoo *sc, const small_cuckoo_opts *opts);
 
 extern void small_cuckoo_iterate(small_cuckoo *sc, small_cuckoo_iter *iter);
 extern bool small_cuckoo_iter_has_next(small_cuckoo_iter *iter);
 extern void small_cuckoo_iter_next(small_cuckoo_iter *iter, uint64_t *key, uint64_t *value);
 
-
-
+#ifdef __cplusplus
+}
+#endif
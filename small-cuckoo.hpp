@@ -0,0 +1,185 @@
+/** -*- mode: C++; c-file-style: "k&r" -*-
+ * C++ front-end to small-cuckoo with the hash pair as a policy.
+ *
+ * A policy is a type with a static member
+ *   uint64_t hash(uint64_t key, uint32_t seed)
+ * following the contract of small_cuckoo_hash_fn, whose high bits
+ * pick the slots.  Lookups call it inline and hand the result to
+ * small_cuckoo_find_hashed; the engine calls it through a pointer
+ * when inserting and rehashing.  Tests are in small-cuckoo-hpp.cpp.
+ * @file small-cuckoo.hpp
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+#include "small-cuckoo.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#endif
+
+namespace small_cuckoo_hash {
+
+/* Seeds enter by multiplying the key by an odd constant, as in the
+ * built-in pair; see seeded() in small-cuckoo.c. */
+static inline uint64_t seeded(uint64_t key, uint32_t seed)
+{
+     return key * (2*(uint64_t)seed + 1);
+}
+
+/** CRC32C, in hardware when the CPU has SSE 4.2, whatever the build
+ * targets; as in small-cuckoo.c, cpuid is asked once.  CRC is linear,
+ * so the second half hashes a multiplied key rather than using another
+ * initial value, which would collide on exactly the same keys. */
+struct crc32c {
+     static uint32_t soft_crc(uint64_t k)
+     {
+          uint32_t h = ~0U;
+          for (int i = 0; i < 64; ++i, k >>= 1)
+               h = (h >> 1) ^ (0x82f63b78U & -((h ^ k) & 1));
+          return h;
+     }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+     __attribute__((target("sse4.2")))
+     static uint32_t hard_crc(uint64_t k)
+     {
+          return _mm_crc32_u64(~0U, k);
+     }
+
+     static bool have_sse42()
+     {
+          static const bool have = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+          return have;
+     }
+
+     static uint32_t crc(uint64_t k)
+     {
+          return have_sse42() ? hard_crc(k) : soft_crc(k);
+     }
+#else
+     static uint32_t crc(uint64_t k) { return soft_crc(k); }
+#endif
+
+     static uint64_t hash(uint64_t key, uint32_t seed)
+     {
+          key = seeded(key, seed);
+          return (uint64_t)crc(key * 0x9e3779b97f4a7c15ULL)<<32 | crc(key);
+     }
+};
+
+/** Dietzfelbinger's multiply-shift with two seed-dependent odd
+ * multipliers.  Cheapest of all; good for dense integer IDs. */
+struct multiply_shift {
+     static uint64_t hash(uint64_t key, uint32_t seed)
+     {
+          uint64_t a = 0x9e3779b97f4a7c15ULL + 2*(uint64_t)seed;
+          uint64_t b = 0xc2b2ae3d27d4eb4fULL + 2*(uint64_t)seed;
+          return ((key * b) & 0xffffffff00000000ULL) | (key * a)>>32;
+     }
+};
+
+/** wyhash's 64-bit mixer: two rounds of folded 128-bit multiplies.
+ * Copes with pointer-like keys and already-hashed strings whose
+ * entropy sits in a few bit positions. */
+struct wymix {
+     static uint64_t mum(uint64_t a, uint64_t b)
+     {
+          __uint128_t r = (__uint128_t)a * b;
+          return (uint64_t)r ^ (uint64_t)(r>>64);
+     }
+
+     static uint64_t hash(uint64_t key, uint32_t seed)
+     {
+          uint64_t h = mum(key ^ 0x2d358dccaa6c78a5ULL, seed ^ 0x8bb84b93962eacc9ULL);
+          return mum(h ^ 0xa0761d6478bd642fULL, key ^ 0xe7037ed1a0b428dbULL);
+     }
+};
+
+/** One 64-bit MurmurHash3 finalizer split into both hashes; see
+ * small_cuckoo_split_hash, which this must match. */
+struct split64 {
+     static uint64_t hash(uint64_t key, uint32_t seed)
+     {
+          uint64_t h = seeded(key, seed);
+          h ^= h>>33;
+          h *= 0xff51afd7ed558ccdULL;
+          h ^= h>>33;
+          h *= 0xc4ceb9fe1a85ec53ULL;
+          return h ^ (h>>33);
+     }
+};
+
+/** The pair small_cuckoo_new uses: Larson's hash with CRC32 or Bob
+ * Jenkins's hash.  Not inlined, but interchangeable with tables built
+ * through the C interface. */
+struct larson_jenkins {
+     static uint64_t hash(uint64_t key, uint32_t seed)
+     {
+          return small_cuckoo_default_hash(key, seed);
+     }
+};
+
+}
+
+template <class Hash>
+class basic_small_cuckoo {
+public:
+     explicit basic_small_cuckoo(size_t initial_size = 0)
+     {
+          small_cuckoo_opts opts = {};
+          opts.hash = &Hash::hash;
+          sc_ = small_cuckoo_new_opts(initial_size, &opts);
+     }
+
+     basic_small_cuckoo(const basic_small_cuckoo &) = delete;
+     basic_small_cuckoo &operator=(const basic_small_cuckoo &) = delete;
+
+     basic_small_cuckoo(basic_small_cuckoo &&other) noexcept : sc_(other.sc_)
+     {
+          other.sc_ = small_cuckoo();
+     }
+
+     basic_small_cuckoo &operator=(basic_small_cuckoo &&other) noexcept
+     {
+          std::swap(sc_, other.sc_);
+          return *this;
+     }
+
+     ~basic_small_cuckoo() { small_cuckoo_free(&sc_); }
+
+     /** False if an entry was given up; see small_cuckoo_insert. */
+     bool insert(uint64_t key, uint64_t value) { return small_cuckoo_insert(&sc_, key, value); }
+
+     /** See small_cuckoo_find_or_insert and small_cuckoo_upsert; throws
+      * std::length_error where they would return NULL. */
+     uint64_t &find_or_insert(uint64_t key, uint64_t value = 0)
+     {
+          return kept(small_cuckoo_find_or_insert(&sc_, key, value));
+     }
+
+     uint64_t &upsert(uint64_t key, uint64_t value) { return kept(small_cuckoo_upsert(&sc_, key, value)); }
+
+     bool find(uint64_t key, uint64_t *value = nullptr)
+     {
+          return small_cuckoo_find_hashed(&sc_, key, Hash::hash(key, sc_.seed), value);
+     }
+
+     size_t size() const { return sc_.n_entries - 1; }
+
+     /** The underlying table, for the rest of the C interface. */
+     small_cuckoo *get() { return &sc_; }
+
+private:
+     static uint64_t &kept(uint64_t *value)
+     {
+          if (!value) throw std::length_error("small_cuckoo: key given up");
+          return *value;
+     }
+
+     small_cuckoo sc_;
+};
@@ -0,0 +1,38 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * The small-cuckoo engine with 32-bit entry indices: small-cuckoo.c
+ * again, with its table type and entry points renamed.  Its tests run
+ * against this build too when compiled with UNIT_TEST.
+ * @file small-cuckoo32.c
+ */
+
+#include "small-cuckoo32.h"
+
+#define SMALL_CUCKOO_WIDE
+
+#define small_cuckoo small_cuckoo32
+#define small_cuckoo_slot small_cuckoo32_slot
+#define small_cuckoo_iter small_cuckoo32_iter
+#define small_cuckoo_new small_cuckoo32_new
+#define small_cuckoo_new_opts small_cuckoo32_new_opts
+#define small_cuckoo_build small_cuckoo32_build
+#define small_cuckoo_build_opts small_cuckoo32_build_opts
+#define small_cuckoo_insert small_cuckoo32_insert
+#define small_cuckoo_reserve small_cuckoo32_reserve
+#define small_cuckoo_shrink_to_fit small_cuckoo32_shrink_to_fit
+#define small_cuckoo_find_or_insert small_cuckoo32_find_or_insert
+#define small_cuckoo_upsert small_cuckoo32_upsert
+#define small_cuckoo_find small_cuckoo32_find
+#define small_cuckoo_erase small_cuckoo32_erase
+#define small_cuckoo_find_hashed small_cuckoo32_find_hashed
+#define small_cuckoo_find_batch small_cuckoo32_find_batch
+#define small_cuckoo_reclaim small_cuckoo32_reclaim
+#define small_cuckoo_free small_cuckoo32_free
+#define small_cuckoo_serialize small_cuckoo32_serialize
+#define small_cuckoo_deserialize small_cuckoo32_deserialize
+#define small_cuckoo_deserialize_opts small_cuckoo32_deserialize_opts
+#define small_cuckoo_iterate small_cuckoo32_iterate
+#define small_cuckoo_iter_has_next small_cuckoo32_iter_has_next
+#define small_cuckoo_iter_next small_cuckoo32_iter_next
+#define larsons_hash small_cuckoo32_larsons_hash
+
+#include "small-cuckoo.c"
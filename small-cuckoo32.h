@@ -0,0 +1,87 @@
+/** -*- mode: C; c-file-style: "k&r" -*-
+ * small_cuckoo with 32-bit entry indices, for tables of more than 64k
+ * keys.  Slots take twice the space; otherwise it is the same engine,
+ * with the same options, built a second time by small-cuckoo32.c, and
+ * each function behaves as its small_cuckoo_ namesake documented in
+ * small-cuckoo.h.  Serialized tables aren't interchangeable between
+ * the two.
+ *
+ * small-cuckoo32.o isn't enough on its own: link small-cuckoo.o too,
+ * built with the same SMALL_CUCKOO_FINGERPRINT setting.  The layout
+ * check symbol and small_cuckoo_split_hash, which the wide build uses,
+ * are only defined there, as is small_cuckoo_default_hash.
+ * @file small-cuckoo32.h
+ */
+#pragma once
+
+#include "small-cuckoo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef SMALL_CUCKOO_FINGERPRINT
+typedef uint64_t small_cuckoo32_slot;
+#else
+typedef uint32_t small_cuckoo32_slot;
+#endif
+
+/* Keep in step with struct small_cuckoo. */
+typedef struct small_cuckoo32 {
+     size_t table_size;
+     small_cuckoo32_slot *table;
+     uint32_t seed;
+     uint8_t ways;
+     small_cuckoo_hash_fn *hash;
+     unsigned flags;
+     small_cuckoo32_slot *old_table;
+     size_t old_table_size, migrated;
+     uint32_t old_seed;
+     small_cuckoo32_slot stash[SMALL_CUCKOO_STASH_SIZE];
+     uint8_t n_stashed;
+     small_cuckoo32_slot queue[SMALL_CUCKOO_QUEUE_SIZE];
+     uint8_t queue_head, n_queued, walk_len, walk_choice;
+     uint32_t n_entries, entries_len;
+     struct {
+          uint64_t key;
+          uint64_t value;
+     } *entries;
+     uint64_t *hashes;
+     small_cuckoo_allocator allocator;
+     uint32_t version;
+     struct small_cuckoo_retired *retired, *retired_before;
+} small_cuckoo32;
+
+typedef struct small_cuckoo32_iter {
+     small_cuckoo32 *sc;
+     size_t i;
+} small_cuckoo32_iter;
+
+extern small_cuckoo32 small_cuckoo32_new(size_t initial_size);
+extern small_cuckoo32 small_cuckoo32_new_opts(size_t initial_size, const small_cuckoo_opts *opts);
+extern small_cuckoo32 small_cuckoo32_build(const uint64_t *keys, const uint64_t *values, size_t n);
+extern small_cuckoo32 small_cuckoo32_build_opts(const uint64_t *keys, const uint64_t *values, size_t n,
+                                                const small_cuckoo_opts *opts);
+extern bool small_cuckoo32_insert(small_cuckoo32 *sc, uint64_t key, uint64_t value);
+extern void small_cuckoo32_reserve(small_cuckoo32 *sc, size_t n);
+extern void small_cuckoo32_shrink_to_fit(small_cuckoo32 *sc);
+extern uint64_t *small_cuckoo32_find_or_insert(small_cuckoo32 *sc, uint64_t key, uint64_t value);
+extern uint64_t *small_cuckoo32_upsert(small_cuckoo32 *sc, uint64_t key, uint64_t value);
+extern bool small_cuckoo32_find(small_cuckoo32 *sc, uint64_t key, uint64_t *value);
+extern bool small_cuckoo32_erase(small_cuckoo32 *sc, uint64_t key);
+extern bool small_cuckoo32_find_hashed(small_cuckoo32 *sc, uint64_t key, uint64_t hash, uint64_t *value);
+extern void small_cuckoo32_find_batch(small_cuckoo32 *sc, const uint64_t *keys, size_t n,
+                                      uint64_t *values, uint64_t *found_mask);
+extern void small_cuckoo32_reclaim(small_cuckoo32 *sc);
+extern void small_cuckoo32_free(small_cuckoo32 *sc);
+extern void small_cuckoo32_serialize(int fd, small_cuckoo32 *sc);
+extern void small_cuckoo32_deserialize(int fd, small_cuckoo32 *sc);
+extern void small_cuckoo32_deserialize_opts(int fd, small_cuckoo32 *sc, const small_cuckoo_opts *opts);
+
+extern void small_cuckoo32_iterate(small_cuckoo32 *sc, small_cuckoo32_iter *iter);
+extern bool small_cuckoo32_iter_has_next(small_cuckoo32_iter *iter);
+extern void small_cuckoo32_iter_next(small_cuckoo32_iter *iter, uint64_t *key, uint64_t *value);
+
+#ifdef __cplusplus
+}
+#endif